@@ -52,6 +52,20 @@ FlashConfig flashDefault = {
   .sscp_loader          = 0,
   .p2_ddloader_enable   = 0,
   .cts_load_enable      = 0,
+  .sscp_pipeline        = 0,
+  .sscp_event_pin       = 0,
+  .uart_flow_control    = 0,
+  .dns_cache_size       = 0,
+  .dns_cache_ttl        = 0,
+  .sscp_connections     = 0,
+  .sscp_buffer_pool     = 0,
+  .tcp_buffer_size      = 0,
+  .udp_buffer_size      = 0,
+  .http_buffer_size     = 0,
+  .http_idle_timeout    = 0,
+  .ws_idle_timeout      = 0,
+  .tcp_idle_timeout     = 0,
+  .udp_idle_timeout     = 0,
   
   #ifdef SIP_MODULE             // SIP module default pin setting
   .enforce_reset_pin    = 1
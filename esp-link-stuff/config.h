@@ -30,6 +30,20 @@ typedef struct {
   int8_t   p2_ddloader_enable;
   int8_t   enforce_reset_pin;
   int8_t   cts_load_enable;
+  int8_t   sscp_pipeline;
+  int8_t   sscp_event_pin;  // GPIO driven high while events are pending, 0 for none
+  int8_t   uart_flow_control; // RTS/CTS on GPIO15/GPIO13, 0 for none
+  int8_t   dns_cache_size;  // number of cached host names, 0 for the default, -1 for none
+  int32_t  dns_cache_ttl;   // seconds a host name stays cached, 0 for the default
+  int8_t   sscp_connections;  // number of connection handles, 0 for the default
+  int32_t  sscp_buffer_pool;  // bytes of connection buffers, 0 for the default
+  int32_t  tcp_buffer_size;   // rx and tx buffer size of each kind of connection, 0 for the largest
+  int32_t  udp_buffer_size;
+  int32_t  http_buffer_size;  // HTTP and websocket connections
+  int32_t  http_idle_timeout; // seconds before an unused connection is closed, 0 for the default, -1 for never
+  int32_t  ws_idle_timeout;   // the same for the other types, their default is never
+  int32_t  tcp_idle_timeout;
+  int32_t  udp_idle_timeout;
 } FlashConfig;
 
 extern FlashConfig flashConfig;
@@ -21,6 +21,8 @@ serbridgeConnData connData[MAX_CONN];
 
 //===== TCP -> UART
 
+static void serbridgeUartTxDoneCb(void);
+
 // Receive callback
 static void ICACHE_FLASH_ATTR
 serbridgeRecvCb(void *arg, char *data, unsigned short len)
@@ -29,6 +31,27 @@ serbridgeRecvCb(void *arg, char *data, unsigned short len)
   //os_printf("Receive callback on conn %p\n", conn);
   if (conn == NULL) return;
   uart_tx_buffer(UART0, data, len);
+  // with flow control the MCU can hold us off for a long time, so stop taking data from
+  // the network until the uart catches up rather than spinning on a full tx ring
+  if (flashConfig.uart_flow_control && !conn->rxheld && uart0_tx_space() < SER_BRIDGE_TX_LOW) {
+    espconn_recv_hold(conn->conn);
+    conn->rxheld = true;
+    // only ask to hear about the ring draining while something waits for it
+    uart0_set_tx_done_cb(serbridgeUartTxDoneCb);
+  }
+}
+
+// Uart tx ring has drained, resume receiving on any connection we held
+static void ICACHE_FLASH_ATTR
+serbridgeUartTxDoneCb(void)
+{
+  uart0_set_tx_done_cb(NULL);
+  for (short i=0; i<MAX_CONN; i++) {
+    if (connData[i].conn && connData[i].rxheld) {
+      connData[i].rxheld = false;
+      espconn_recv_unhold(connData[i].conn);
+    }
+  }
 }
 
 //===== UART -> TCP
@@ -248,6 +271,7 @@ serbridgeInitPins()
   if (flashConfig.rx_pullup) PIN_PULLUP_EN(PERIPHS_IO_MUX_U0RXD_U);
   else                       PIN_PULLUP_DIS(PERIPHS_IO_MUX_U0RXD_U);
   system_uart_de_swap();
+  uart0_flow_control(flashConfig.uart_flow_control);
 
   // set both pins to 1 before turning them on so we don't cause a reset
   if (mcu_reset_pin >= 0) GPIO_OUTPUT_SET(mcu_reset_pin, 1);
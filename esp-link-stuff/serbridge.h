@@ -11,6 +11,9 @@
 // Send buffer size
 #define MAX_TXBUFFER (2*1460)
 
+// With flow control, stop taking data from the network when the uart tx ring has less room than this
+#define SER_BRIDGE_TX_LOW 512
+
 enum connModes {
   cmInit = 0,        // initialization mode: nothing received yet
   cmPGMInit,         // initialization mode for programming
@@ -28,6 +31,7 @@ typedef struct serbridgeConnData {
   char           *sentbuffer;   // buffer sent, awaiting callback to get freed
   uint32_t       txoverflow_at; // when the transmitter started to overflow
 	bool           readytosend;   // true, if txbuffer can be sent by espconn_sent
+  bool           rxheld;        // true, if receiving is on hold until the uart catches up
 } serbridgeConnData;
 
 // port1 is transparent&programming, second port is programming only
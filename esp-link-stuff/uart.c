@@ -36,8 +36,10 @@ static int uart0_baudRate = -1;
 static int uart0_stopBits = -1;
 static int uart1_baudRate = -1;
 static int uart1_stopBits = -1;
+static int uart0_flowControl;   // RTS/CTS on, read by the isr
 
 LOCAL uint8_t uart_recvTaskNum;
+LOCAL uint8_t uart_txDoneTaskNum;
 
 // UartDev is defined and initialized in rom code.
 extern UartDevice    UartDev;
@@ -46,6 +48,38 @@ static UartRecv_cb uart_recv_cb[4];
 
 static void uart0_rx_intr_handler(void *para);
 
+// UART0 transmit ring. The task side appends at the head, the TX-FIFO-empty interrupt moves
+// bytes from the tail into the hardware FIFO. Whenever the task side has to touch the tail
+// (pumping the ring by hand because it is full or being drained) it masks the TX interrupt
+// first, so the two never run against each other.
+#define UART0_TX_RING_SIZE  1024    // must be a power of two
+#define UART0_TX_RING_MASK  (UART0_TX_RING_SIZE - 1)
+#define UART_TX_FIFO_FILL   126     // fill the 128 byte hardware fifo up to this level
+#define UART_TX_FIFO_LOW    16      // tx-empty interrupt fires when the fifo drops below this
+
+#define UART_TXFIFO_COUNT(uart) ((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)
+
+static char uart0_txRing[UART0_TX_RING_SIZE];
+static volatile uint16 uart0_txHead;
+static volatile uint16 uart0_txTail;
+static UartTxDone_cb uart0_txDoneCb;
+
+// UART0 receive ring. The interrupt handler empties the hardware FIFO into it as soon as the
+// FIFO fills up or times out, so bytes are not lost while WiFi callbacks keep uart_recvTask
+// from running. The size can be overridden from the Makefile.
+#ifndef UART0_RX_RING_SIZE
+#define UART0_RX_RING_SIZE  2048    // must be a power of two
+#endif
+#define UART0_RX_RING_MASK  (UART0_RX_RING_SIZE - 1)
+
+static char uart0_rxRing[UART0_RX_RING_SIZE];
+static volatile uint16 uart0_rxHead;    // advanced by the isr
+static volatile uint16 uart0_rxTail;    // advanced by uart_recvTask
+static volatile uint8 uart0_rxPosted;   // uart_recvTask has been posted but not run yet
+static volatile uint8 uart0_rxBreak;    // a break was detected on the line
+
+UartRxStats uart0_rxStats;
+
 /******************************************************************************
  * FunctionName : uart_config
  * Description  : Internal used function
@@ -78,7 +112,8 @@ uart_config(uint8 uart_no)
         CALC_UARTMODE(EIGHT_BITS, NONE_BITS, ONE_STOP_BIT));
   else
     WRITE_PERI_REG(UART_CONF0(uart_no),
-        CALC_UARTMODE(UartDev.data_bits, UartDev.parity, UartDev.stop_bits));
+        CALC_UARTMODE(UartDev.data_bits, UartDev.parity, UartDev.stop_bits) |
+        (uart0_flowControl ? UART_TX_FLOW_EN : 0));
 
   //clear rx and tx fifo,not ready
   SET_PERI_REG_MASK(UART_CONF0(uart_no), UART_RXFIFO_RST | UART_TXFIFO_RST);
@@ -98,8 +133,9 @@ uart_config(uint8 uart_no)
                    ((100 & UART_RX_FLOW_THRHD) << UART_RX_FLOW_THRHD_S) |
                    UART_RX_FLOW_EN |
                    (4 & UART_RX_TOUT_THRHD) << UART_RX_TOUT_THRHD_S |
-                   UART_RX_TOUT_EN);
-    SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA | UART_BRK_DET_INT_RAW);
+                   UART_RX_TOUT_EN |
+                   ((UART_TX_FIFO_LOW & UART_TXFIFO_EMPTY_THRHD) << UART_TXFIFO_EMPTY_THRHD_S));
+    SET_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA | UART_BRK_DET_INT_ENA);
   } else {
     WRITE_PERI_REG(UART_CONF1(uart_no),
                    ((UartDev.rcv_buff.TrigLvl & UART_RXFIFO_FULL_THRHD) << UART_RXFIFO_FULL_THRHD_S));
@@ -109,6 +145,134 @@ uart_config(uint8 uart_no)
   WRITE_PERI_REG(UART_INT_CLR(uart_no), 0xffff);
 }
 
+/******************************************************************************
+ * FunctionName : uart0_tx_space
+ * Description  : Number of bytes that can be queued without blocking
+ * Parameters   : NONE
+ * Returns      : free space in the UART0 transmit ring
+*******************************************************************************/
+uint16 ICACHE_FLASH_ATTR
+uart0_tx_space(void)
+{
+  return (uart0_txTail - uart0_txHead - 1) & UART0_TX_RING_MASK;
+}
+
+/******************************************************************************
+ * FunctionName : uart0_tx_pending
+ * Description  : Number of bytes still to go out on UART0
+ * Parameters   : NONE
+ * Returns      : bytes waiting in the transmit ring and the hardware fifo
+*******************************************************************************/
+uint16 ICACHE_FLASH_ATTR
+uart0_tx_pending(void)
+{
+  return UART0_TX_RING_SIZE - 1 - uart0_tx_space() + UART_TXFIFO_COUNT(UART0);
+}
+
+// Internal: set or clear bits in UART_INT_ENA. The isr clears bits in it too, so the
+// read-modify-write must not be interrupted.
+static void ICACHE_FLASH_ATTR
+uart0_int_ena_set(uint32 mask)
+{
+  ETS_UART_INTR_DISABLE();
+  SET_PERI_REG_MASK(UART_INT_ENA(UART0), mask);
+  ETS_UART_INTR_ENABLE();
+}
+
+static void ICACHE_FLASH_ATTR
+uart0_int_ena_clear(uint32 mask)
+{
+  ETS_UART_INTR_DISABLE();
+  CLEAR_PERI_REG_MASK(UART_INT_ENA(UART0), mask);
+  ETS_UART_INTR_ENABLE();
+}
+
+// Internal: stop the isr from draining the ring
+static void ICACHE_FLASH_ATTR
+uart0_tx_intr_off(void)
+{
+  uart0_int_ena_clear(UART_TXFIFO_EMPTY_INT_ENA);
+}
+
+// Internal: let the isr drain the ring, also when it is empty but someone wants to hear about it
+static void ICACHE_FLASH_ATTR
+uart0_tx_intr_on(void)
+{
+  if (uart0_txHead != uart0_txTail || uart0_txDoneCb != NULL)
+    uart0_int_ena_set(UART_TXFIFO_EMPTY_INT_ENA);
+}
+
+// Internal: move bytes from the ring into the fifo by hand until at least 'needed' bytes
+// are free in the ring. The tx interrupt must be masked.
+static void ICACHE_FLASH_ATTR
+uart0_tx_pump(uint16 needed)
+{
+  while (uart0_tx_space() < needed) {
+    while (UART_TXFIFO_COUNT(UART0) >= UART_TX_FIFO_FILL) ;
+    while (uart0_txTail != uart0_txHead && UART_TXFIFO_COUNT(UART0) < UART_TX_FIFO_FILL) {
+      WRITE_PERI_REG(UART_FIFO(UART0), uart0_txRing[uart0_txTail]);
+      uart0_txTail = (uart0_txTail + 1) & UART0_TX_RING_MASK;
+    }
+  }
+}
+
+/******************************************************************************
+ * FunctionName : uart0_tx_enqueue
+ * Description  : Queue bytes for transmission on UART0 without blocking
+ * Parameters   : char *buf - bytes to send
+ *                uint16 len - number of bytes
+ * Returns      : number of bytes accepted, less than len if the ring is full
+*******************************************************************************/
+uint16 ICACHE_FLASH_ATTR
+uart0_tx_enqueue(char *buf, uint16 len)
+{
+  uint16 i = 0;
+
+  uart0_tx_intr_off();
+
+  // nothing is queued ahead of us so go straight to the fifo while it has room
+  if (uart0_txHead == uart0_txTail) {
+    while (i < len && UART_TXFIFO_COUNT(UART0) < UART_TX_FIFO_FILL)
+      WRITE_PERI_REG(UART_FIFO(UART0), buf[i++]);
+  }
+
+  while (i < len && uart0_tx_space() > 0) {
+    uart0_txRing[uart0_txHead] = buf[i++];
+    uart0_txHead = (uart0_txHead + 1) & UART0_TX_RING_MASK;
+  }
+
+  uart0_tx_intr_on();
+  return i;
+}
+
+// Internal: queue all of buf, pumping the ring by hand whenever it is full. This also works
+// when the uart interrupt is disabled.
+static void ICACHE_FLASH_ATTR
+uart0_tx_write(char *buf, uint16 len)
+{
+  uint16 sent;
+  while ((sent = uart0_tx_enqueue(buf, len)) < len) {
+    buf += sent;
+    len -= sent;
+    uart0_tx_intr_off();
+    uart0_tx_pump(len < UART_TX_FIFO_FILL ? len : UART_TX_FIFO_FILL);
+  }
+}
+
+/******************************************************************************
+ * FunctionName : uart0_set_tx_done_cb
+ * Description  : Set the function called on the system task once everything
+ *                queued on UART0 has been moved into the hardware fifo
+ * Parameters   : UartTxDone_cb cb - callback, NULL to remove it
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_set_tx_done_cb(UartTxDone_cb cb)
+{
+  uart0_txDoneCb = cb;
+  uart0_tx_intr_on();
+}
+
 /******************************************************************************
  * FunctionName : uart_tx_one_char
  * Description  : Transmit a character
@@ -119,8 +283,12 @@ uart_config(uint8 uart_no)
 STATUS ICACHE_FLASH_ATTR
 uart_tx_one_char(uint8 uart, uint8 c)
 {
+  if (uart == UART0) {
+    uart0_tx_write((char *)&c, 1);
+    return OK;
+  }
   //Wait until there is room in the FIFO
-  while (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=100) ;
+  while (UART_TXFIFO_COUNT(uart)>=100) ;
   //Send the character
   WRITE_PERI_REG(UART_FIFO(uart), c);
   return OK;
@@ -136,8 +304,10 @@ uart_tx_one_char(uint8 uart, uint8 c)
 STATUS ICACHE_FLASH_ATTR
 uart_try_tx_one_char(uint8 uart, uint8 c)
 {
+  if (uart == UART0)
+    return uart0_tx_enqueue((char *)&c, 1) == 1 ? OK : FAIL;
   //Check for room in the FIFO
-  if (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>=100)
+  if (UART_TXFIFO_COUNT(uart)>=100)
     return FAIL;
   //Send the character
   WRITE_PERI_REG(UART_FIFO(uart), c);
@@ -153,14 +323,21 @@ uart_try_tx_one_char(uint8 uart, uint8 c)
 STATUS ICACHE_FLASH_ATTR
 uart_drain_tx_buffer(uint8 uart)
 {
-  //Check for room in the FIFO
-  while (((READ_PERI_REG(UART_STATUS(uart))>>UART_TXFIFO_CNT_S)&UART_TXFIFO_CNT)>0) ;
+  //Empty the ring into the FIFO
+  if (uart == UART0) {
+    uart0_tx_intr_off();
+    uart0_tx_pump(UART0_TX_RING_SIZE - 1);
+    uart0_tx_intr_on();
+  }
+  //Wait for the FIFO to empty
+  while (UART_TXFIFO_COUNT(uart)>0) ;
   return OK;
 }
 
 /******************************************************************************
  * FunctionName : uart_tx_buffer
- * Description  : use uart to transfer buffer
+ * Description  : use uart to transfer buffer, only blocks on UART0 when the
+ *                transmit ring is full
  * Parameters   : uint8 uart - uart to use
  *                uint8 *buf - point to send buffer
  *                uint16 len - buffer len
@@ -171,6 +348,11 @@ uart_tx_buffer(uint8 uart, char *buf, uint16 len)
 {
   uint16 i;
 
+  if (uart == UART0) {
+    uart0_tx_write(buf, len);
+    return;
+  }
+
   for (i = 0; i < len; i++)
   {
     uart_tx_one_char(uart, buf[i]);
@@ -196,6 +378,7 @@ uart0_rx_intr_handler(void *para)
   // we end up largely ignoring framing errors and we just print a warning every second max
   if (READ_PERI_REG(UART_INT_RAW(uart_no)) & UART_FRM_ERR_INT_RAW) {
     uint32 now = system_get_time();
+    ++uart0_rxStats.framingErrors;
     if (last_frm_err == 0 || (now - last_frm_err) > one_sec) {
       os_printf("UART framing error (bad baud rate?)\n");
       last_frm_err = now;
@@ -210,56 +393,111 @@ uart0_rx_intr_handler(void *para)
     last_frm_err = 0;
   }
 
+  // the fifo overflow interrupt isn't enabled either, we just count them
+  if (READ_PERI_REG(UART_INT_RAW(uart_no)) & UART_RXFIFO_OVF_INT_RAW) {
+    ++uart0_rxStats.fifoOverflows;
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_OVF_INT_CLR);
+  }
+
+  // refill the tx fifo from the ring, everything used here has to live in RAM
+  if (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_TXFIFO_EMPTY_INT_ST) {
+    while (uart0_txTail != uart0_txHead && UART_TXFIFO_COUNT(uart_no) < UART_TX_FIFO_FILL) {
+      WRITE_PERI_REG(UART_FIFO(uart_no), uart0_txRing[uart0_txTail]);
+      uart0_txTail = (uart0_txTail + 1) & UART0_TX_RING_MASK;
+    }
+    if (uart0_txTail == uart0_txHead) {
+      CLEAR_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_TXFIFO_EMPTY_INT_ENA);
+      if (uart0_txDoneCb != NULL)
+        post_usr_task(uart_txDoneTaskNum, 0);
+    }
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_TXFIFO_EMPTY_INT_CLR);
+  }
+
   int schedule = 0;
 
-  if (READ_PERI_REG(UART_INT_RAW(uart_no)) & UART_BRK_DET_INT_RAW)
+  // a break holds the line low for a long time, so mask it until uart_recvTask has seen it
+  if (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_BRK_DET_INT_ST) {
+    CLEAR_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_BRK_DET_INT_ENA);
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_BRK_DET_INT_CLR);
+    uart0_rxBreak = 1;
     schedule = 1;
+  }
 
-  if (UART_RXFIFO_FULL_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_FULL_INT_ST)
-  ||  UART_RXFIFO_TOUT_INT_ST == (READ_PERI_REG(UART_INT_ST(uart_no)) & UART_RXFIFO_TOUT_INT_ST))
+  if (READ_PERI_REG(UART_INT_ST(uart_no)) & (UART_RXFIFO_FULL_INT_ST | UART_RXFIFO_TOUT_INT_ST))
   {
-    //DBG_UART("stat:%02X",*(uint8 *)UART_INT_ENA(uart_no));
+    while (READ_PERI_REG(UART_STATUS(uart_no)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) {
+      char c = READ_PERI_REG(UART_FIFO(uart_no)) & 0xFF;
+      uint16 next = (uart0_rxHead + 1) & UART0_RX_RING_MASK;
+      if (next == uart0_rxTail) {
+        ++uart0_rxStats.ringOverflows;
+        continue;
+      }
+      uart0_rxRing[uart0_rxHead] = c;
+      uart0_rxHead = next;
+      // with flow control leave the rest in the fifo, once that fills up RTS holds off the sender
+      if (uart0_flowControl && ((uart0_rxHead + 1) & UART0_RX_RING_MASK) == uart0_rxTail) {
+        CLEAR_PERI_REG_MASK(UART_INT_ENA(uart_no), UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA);
+        break;
+      }
+    }
+    WRITE_PERI_REG(UART_INT_CLR(uart_no), UART_RXFIFO_FULL_INT_CLR|UART_RXFIFO_TOUT_INT_CLR);
     schedule = 1;
   }
 
-  if (schedule) {
-    ETS_UART_INTR_DISABLE();
+  if (schedule && !uart0_rxPosted) {
+    uart0_rxPosted = 1;
     post_usr_task(uart_recvTaskNum, 0);
   }
 }
 
 /******************************************************************************
  * FunctionName : uart_recvTask
- * Description  : system task triggered on receive interrupt, empties FIFO and calls callbacks
+ * Description  : system task triggered on receive interrupt, hands the bytes in the
+ *                receive ring to the callbacks
 *******************************************************************************/
 static void ICACHE_FLASH_ATTR
 uart_recvTask(os_event_t *events)
 {
-  if (READ_PERI_REG(UART_INT_RAW(UART0)) & UART_BRK_DET_INT_RAW) {
-    WRITE_PERI_REG(UART_INT_CLR(UART0), UART_BRK_DET_INT_CLR);
+  // anything the isr receives from here on gets us posted again
+  uart0_rxPosted = 0;
+
+  if (uart0_rxBreak) {
+    uart0_rxBreak = 0;
     os_printf("UART break detected. Switching on SSCP command parsing.\n");
     sscp_reset();
     flashConfig.sscp_enable = 1;
+    WRITE_PERI_REG(UART_INT_CLR(UART0), UART_BRK_DET_INT_CLR);
+    uart0_int_ena_set(UART_BRK_DET_INT_ENA);
   }
 
-  while (READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) {
-    //WRITE_PERI_REG(0X60000914, 0x73); //WTD // commented out by TvE
-
-    // read a buffer-full from the uart
-    uint16 length = 0;
-    char buf[128];
-    while ((READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) &&
-           (length < 128)) {
-      buf[length++] = READ_PERI_REG(UART_FIFO(UART0)) & 0xFF;
-    }
+  // hand out at most the two contiguous runs that are in the ring right now
+  uint16 head = uart0_rxHead;
+  while (uart0_rxTail != head) {
+    uint16 tail = uart0_rxTail;
+    short length = (head > tail ? head : UART0_RX_RING_SIZE) - tail;
     //DBG_UART("%d ix %d\n", system_get_time(), length);
 
     for (int i=0; i<MAX_CB; i++) {
-      if (uart_recv_cb[i] != NULL) (uart_recv_cb[i])(buf, length);
+      if (uart_recv_cb[i] != NULL) (uart_recv_cb[i])(uart0_rxRing + tail, length);
     }
+    uart0_rxTail = (tail + length) & UART0_RX_RING_MASK;
   }
-  WRITE_PERI_REG(UART_INT_CLR(UART0), UART_RXFIFO_FULL_INT_CLR|UART_RXFIFO_TOUT_INT_CLR);
-  ETS_UART_INTR_ENABLE();
+
+  // the isr may have stopped taking bytes because the ring was full
+  if (uart0_flowControl)
+    uart0_int_ena_set(UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA);
+}
+
+/******************************************************************************
+ * FunctionName : uart_txDoneTask
+ * Description  : system task posted by the interrupt handler once the tx ring is empty
+*******************************************************************************/
+static void ICACHE_FLASH_ATTR
+uart_txDoneTask(os_event_t *events)
+{
+  // more may have been queued since the task was posted
+  if (uart0_txDoneCb != NULL && uart0_txHead == uart0_txTail)
+    (*uart0_txDoneCb)();
 }
 
 // Turn UART interrupts off and poll for nchars or until timeout hits
@@ -267,6 +505,12 @@ uint16_t ICACHE_FLASH_ATTR
 uart0_rx_poll(char *buff, uint16_t nchars, uint32_t timeout_us) {
   ETS_UART_INTR_DISABLE();
   uint16_t got = 0;
+  // whatever the isr already picked up comes first
+  while (uart0_rxTail != uart0_rxHead) {
+    buff[got++] = uart0_rxRing[uart0_rxTail];
+    uart0_rxTail = (uart0_rxTail + 1) & UART0_RX_RING_MASK;
+    if (got == nchars) goto done;
+  }
   uint32_t start = system_get_time(); // time in us
   while (system_get_time()-start < timeout_us) {
     while (READ_PERI_REG(UART_STATUS(UART0)) & (UART_RXFIFO_CNT << UART_RXFIFO_CNT_S)) {
@@ -284,18 +528,49 @@ uart0_config(int baudRate, int stopBits) {
   static char *stopBitNames[4] = { "(error)", "1", "1.5", "2" };
   if (baudRate != uart0_baudRate || stopBits != uart0_stopBits) {
     os_printf("UART: %d baud, %s stop bit%s\n", baudRate, stopBitNames[stopBits & 3], stopBits == 1 ? "" : "s");
+    // don't change the line settings under bytes still waiting in the tx ring
+    uart_drain_tx_buffer(UART0);
     if (baudRate != uart0_baudRate) {
         uart_div_modify(UART0, UART_CLK_FREQ / baudRate);
         uart0_baudRate = baudRate;
     }
     if (stopBits != uart0_stopBits) {
         WRITE_PERI_REG(UART_CONF0(0),
-            CALC_UARTMODE(UartDev.data_bits, UartDev.parity, stopBits));
+            CALC_UARTMODE(UartDev.data_bits, UartDev.parity, stopBits) |
+            (uart0_flowControl ? UART_TX_FLOW_EN : 0));
         uart0_stopBits = stopBits;
     }
    }
 }
 
+/******************************************************************************
+ * FunctionName : uart0_flow_control
+ * Description  : Turn RTS/CTS hardware flow control on UART0 on or off. This
+ *                muxes GPIO13 as CTS and GPIO15 as RTS, or back to plain GPIOs.
+ *                RTS is driven by the hardware once the rx fifo holds 100 bytes,
+ *                which with flow control on also happens when the rx ring is full.
+ * Parameters   : int enable - non-zero to turn flow control on
+ * Returns      : NONE
+*******************************************************************************/
+void ICACHE_FLASH_ATTR
+uart0_flow_control(int enable)
+{
+  if (enable) {
+    PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTCK_U, FUNC_U0CTS);
+    PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTDO_U, FUNC_U0RTS);
+    SET_PERI_REG_MASK(UART_CONF0(UART0), UART_TX_FLOW_EN);
+  } else {
+    CLEAR_PERI_REG_MASK(UART_CONF0(UART0), UART_TX_FLOW_EN);
+    if (uart0_flowControl) {
+      PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTCK_U, FUNC_GPIO13);
+      PIN_FUNC_SELECT(PERIPHS_IO_MUX_MTDO_U, FUNC_GPIO15);
+    }
+  }
+  uart0_flowControl = enable ? 1 : 0;
+  // pick up anything the isr left in the fifo while it was holding off
+  uart0_int_ena_set(UART_RXFIFO_FULL_INT_ENA | UART_RXFIFO_TOUT_INT_ENA);
+}
+
 void ICACHE_FLASH_ATTR
 uart1_config(int baudRate, int stopBits) {
   static char *stopBitNames[4] = { "(error)", "1", "1.5", "2" };
@@ -323,6 +598,10 @@ uart1_config(int baudRate, int stopBits) {
 void ICACHE_FLASH_ATTR
 uart_init(UartBaudRate uart0_br, UartBaudRate uart1_br)
 {
+  // the isr may post these as soon as uart0 is configured
+  uart_recvTaskNum = register_usr_task(uart_recvTask);
+  uart_txDoneTaskNum = register_usr_task(uart_txDoneTask);
+
   // rom use 74880 baut_rate, here reinitialize
   UartDev.baud_rate = uart0_br;
   UartDev.stop_bits = DEF_STOP_BITS;
@@ -333,8 +612,6 @@ uart_init(UartBaudRate uart0_br, UartBaudRate uart1_br)
   for (int i=0; i<4; i++) uart_tx_one_char(UART1, '\n');
   for (int i=0; i<4; i++) uart_tx_one_char(UART0, '\n');
   ETS_UART_INTR_ENABLE();
-
-  uart_recvTaskNum = register_usr_task(uart_recvTask);
 }
 
 void ICACHE_FLASH_ATTR
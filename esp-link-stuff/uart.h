@@ -6,6 +6,9 @@
 // Receive callback function signature
 typedef void (*UartRecv_cb)(char *buf, short len);
 
+// Transmit-done callback function signature
+typedef void (*UartTxDone_cb)(void);
+
 // Initialize UARTs to the provided baud rates (115200 recommended). This also makes the os_printf
 // calls use uart1 for output (for debugging purposes)
 void uart_init(UartBaudRate uart0_br, UartBaudRate uart1_br);
@@ -15,15 +18,33 @@ STATUS uart_tx_one_char(uint8 uart, uint8 c);
 STATUS uart_try_tx_one_char(uint8 uart, uint8 c);
 STATUS uart_drain_tx_buffer(uint8 uart);
 
+// UART0 output goes through an interrupt-driven ring buffer. uart_tx_buffer and uart_tx_one_char
+// only block while the ring is full, uart0_tx_enqueue never blocks and returns how many bytes it
+// took. The done callback is called on the system task each time the ring has emptied.
+uint16 uart0_tx_enqueue(char *buf, uint16 len);
+uint16 uart0_tx_space(void);
+uint16 uart0_tx_pending(void);
+void uart0_set_tx_done_cb(UartTxDone_cb cb);
+
 // Add a receive callback function, this is called on the uart receive task each time a chunk
 // of bytes are received. A small number of callbacks can be added and they are all called
 // with all new characters.
 void uart_add_recv_cb(UartRecv_cb cb);
 
+// UART0 receive error counters, maintained by the interrupt handler
+typedef struct {
+  uint32 fifoOverflows;   // times the hardware fifo overflowed before the isr got to it
+  uint32 ringOverflows;   // bytes dropped because the receive ring was full
+  uint32 framingErrors;   // framing errors seen (usually a baud rate mismatch)
+} UartRxStats;
+
+extern UartRxStats uart0_rxStats;
+
 // Turn UART interrupts off and poll for nchars or until timeout hits
 uint16_t uart0_rx_poll(char *buff, uint16_t nchars, uint32_t timeout_us);
 
 void uart0_config(int baudRate, int stopBits);
+void uart0_flow_control(int enable);
 void uart1_config(int baudRate, int stopBits);
 
 
@@ -21,40 +21,97 @@ Esp8266 http server - core routines
 #define MAX_HEAD_LEN 1024
 //Max post buffer len. This is dynamically malloc'ed if needed.
 #define MAX_POST 1024
-//Max send buffer len. This is allocated on the stack.
+//Max send buffer len. One buffer of this size is reserved for each connection slot.
 #define MAX_SENDBUFF_LEN 2048
 //If some data can't be sent because the underlaying socket doesn't accept the data (like the nonos
-//layer is prone to do), we put it in a backlog that is dynamically malloc'ed. This defines the max
-//size of the backlog.
+//layer is prone to do), we put it in a backlog: a ring buffer that is malloc'ed when a connection
+//needs it and freed again once it has been sent. This defines the size of the ring.
 #define MAX_BACKLOG_SIZE (4*1024)
+//The backlog is sent in pieces of up to one TCP segment, so small writes queued behind each
+//other go out together.
+#define BACKLOG_SEGMENT_LEN 1460
+
+//Bytes httpdSend keeps free at the end of the send buffer for a chunked body: the
+//cr/lf ending the chunk and the "0\r\n\r\n" terminating chunk.
+#define CHUNK_TRAILER_LEN (2+5)
 
 //This gets set at init time.
 static HttpdBuiltInUrl *builtInUrls;
 
-typedef struct HttpSendBacklogItem HttpSendBacklogItem;
+//builtInUrls compiled at init time. Exact urls are hashed on the whole url, wildcard urls on the
+//part before the '*'. Each bucket chains the table indices with that hash in table order, so a
+//lookup costs one pass over the requested url however many urls are registered.
+#define ROUTE_HASH_SIZE 32
 
-struct HttpSendBacklogItem {
-	int len;
-	HttpSendBacklogItem *next;
-	char data[];
-};
+// FNV-1a
+#define ROUTE_HASH_INIT 2166136261u
+#define ROUTE_HASH_STEP(h, c) (((h)^(uint8)(c))*16777619u)
+
+typedef struct {
+	uint32 hash;
+	short prefixLen;	//Length before the '*' for wildcard urls, -1 for exact urls
+	short next;			//Next table index in the same bucket, -1 at the end
+} HttpdRoute;
+
+static HttpdRoute *routes;
+static short routeExact[ROUTE_HASH_SIZE];
+static short routeWild[ROUTE_HASH_SIZE];
 
 //Flags
 #define HFL_HTTP11 (1<<0)
 #define HFL_CHUNKED (1<<1)
 #define HFL_SENDINGBODY (1<<2)
 #define HFL_DISCONAFTERSENT (1<<3)
+#define HFL_KEEPALIVE (1<<4)
+#define HFL_CONTENTLEN (1<<5)
+#define HFL_PERSIST (1<<6)
+#define HFL_UPGRADE (1<<7)
+
+//Request headers the parser keeps the position of, so httpdGetHeader can find them without
+//scanning the whole head. Keep in sync with indexedHeaders[].
+enum {
+	HDR_HOST,
+	HDR_CONNECTION,
+	HDR_CONTENT_LENGTH,
+	HDR_CONTENT_TYPE,
+	HDR_UPGRADE,
+	HDR_IF_NONE_MATCH,
+	HDR_RANGE,
+	HDR_ACCEPT_ENCODING,
+	HDR_AUTHORIZATION,
+	HDR_SEC_WEBSOCKET_KEY,
+	HDR_COUNT
+};
+
+static const char * const indexedHeaders[HDR_COUNT]={
+	"Host",
+	"Connection",
+	"Content-Length",
+	"Content-Type",
+	"Upgrade",
+	"If-None-Match",
+	"Range",
+	"Accept-Encoding",
+	"Authorization",
+	"Sec-WebSocket-Key",
+};
 
 //Private data for http connection
 struct HttpdPriv {
-	char head[MAX_HEAD_LEN];
+	char head[MAX_HEAD_LEN];	//Request head, stored as zero-terminated lines
 	int headPos;
+	int lineStart;				//Offset in head of the line being received
+	int lineLen;				//Bytes received for that line, including any that didn't fit
+	int hdrStart;				//Offset in head of the first line after the request line
+	short hdrValue[HDR_COUNT];	//Offset in head of the value of each indexed header, 0 if absent
+	int postLen;				//Content-Length of the request, if any
 	char *sendBuff;
 	int sendBuffLen;
     int sendBuffMax;
 	char *chunkHdr;
-	HttpSendBacklogItem *sendBacklog;
-	int sendBacklogSize;
+	char *sendBacklog;			//Backlog ring buffer, NULL until first needed
+	int sendBacklogHead;		//Offset in the ring of the oldest queued byte
+	int sendBacklogSize;		//Bytes queued in the ring
 	int flags;
 };
 
@@ -62,6 +119,14 @@ struct HttpdPriv {
 //Connection pool
 static HttpdConnData *connData[HTTPD_MAX_CONNECTIONS];
 
+//Send buffers, MAX_SENDBUFF_LEN bytes for each connection slot. These used to be malloc'ed and
+//freed again in every callback, which fragments the heap when several connections are busy. Now
+//they're malloc'ed once by httpdInit, so the heap counters include them.
+static char *sendBuffPool;
+
+//Heap usage counters
+HttpdStats httpdStats;
+
 //Struct to keep extension->mime data in
 typedef struct {
 	const char *ext;
@@ -99,20 +164,26 @@ const char ICACHE_FLASH_ATTR *httpdGetMimetype(char *url) {
 	return mimeTypes[i].mimetype;
 }
 
+//malloc() that keeps track of the heap the server uses
+static void ICACHE_FLASH_ATTR *httpdMalloc(int len) {
+	uint32 heap;
+	void *p=malloc(len);
+	if (p==NULL) {
+		httpdStats.mallocFailures++;
+		return NULL;
+	}
+	httpdStats.mallocs++;
+	heap=system_get_free_heap_size();
+	if (httpdStats.minFreeHeap==0 || heap<httpdStats.minFreeHeap) httpdStats.minFreeHeap=heap;
+	return p;
+}
+
 //Retires a connection for re-use
 static void ICACHE_FLASH_ATTR httpdRetireConn(HttpdConnData *conn) {
     if (conn==NULL) return;
     if (conn->conn && conn->conn->reverse == conn)
         conn->conn->reverse = NULL; // break reverse link
-	if (conn->priv->sendBacklog!=NULL) {
-		HttpSendBacklogItem *i, *j;
-		i=conn->priv->sendBacklog;
-		do {
-			j=i;
-			i=i->next;
-			free(j);
-		} while (i!=NULL);
-	}
+	if (conn->priv->sendBacklog!=NULL) free(conn->priv->sendBacklog);
 	if (conn->post!=NULL) {
 	    if (conn->post->buff!=NULL) free(conn->post->buff);
 	    free(conn->post);
@@ -160,6 +231,15 @@ int ICACHE_FLASH_ATTR httpdUrlDecode(char *val, int valLen, char *ret, int retLe
 	return d;
 }
 
+//Returns the index of a header name in indexedHeaders[], or -1 if it isn't indexed.
+static int ICACHE_FLASH_ATTR httpdHeaderId(const char *name, int len) {
+	int i;
+	for (i=0; i<HDR_COUNT; i++) {
+		if (strncasecmp(indexedHeaders[i], name, len)==0 && indexedHeaders[i][len]==0) return i;
+	}
+	return -1;
+}
+
 //Find a specific arg in a string of get- or post-data.
 //Line is the string of post/get-data, arg is the name of the value to find. The
 //zero-terminated result is written in buff, with at most buffLen bytes used. The
@@ -188,30 +268,35 @@ int ICACHE_FLASH_ATTR httpdFindArg(char *line, char *arg, char *buff, int buffLe
 //Get the value of a certain header in the HTTP client head
 //Returns true when found, false when not found.
 int ICACHE_FLASH_ATTR httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen) {
-	char *p=conn->priv->head;
-	p=p+strlen(p)+1; //skip GET/POST part
-	p=p+strlen(p)+1; //skip HTTP part
-	while (p<(conn->priv->head+conn->priv->headPos)) {
-		while(*p<=32 && *p!=0) p++; //skip crap at start
-		//See if this is the header
-		if (strncmp(p, header, strlen(header))==0 && p[strlen(header)]==':') {
-			//Skip 'key:' bit of header line
-			p=p+strlen(header)+1;
-			//Skip past spaces after the colon
+	int len=strlen(header);
+	int id=httpdHeaderId(header, len);
+	char *p=NULL;
+	if (id>=0) {
+		//Indexed while parsing: no need to look for it.
+		if (conn->priv->hdrValue[id]!=0) p=&conn->priv->head[conn->priv->hdrValue[id]];
+	} else if (conn->priv->hdrStart!=0) {
+		//Not indexed; walk the zero-terminated header lines.
+		char *e=conn->priv->head+conn->priv->lineStart;
+		for (p=conn->priv->head+conn->priv->hdrStart; p<e; p+=strlen(p)+1) {
+			if (strncasecmp(p, header, len)==0 && p[len]==':') break;
+		}
+		if (p<e) {
+			//Skip 'key:' bit of header line and the spaces after the colon
+			p+=len+1;
 			while(*p==' ') p++;
-			//Copy from p to end
-			while (*p!=0 && *p!='\r' && *p!='\n' && retLen>1) {
-				*ret++=*p++;
-				retLen--;
-			}
-			//Zero-terminate string
-			*ret=0;
-			//All done :)
-			return 1;
+		} else {
+			p=NULL;
 		}
-		p+=strlen(p)+1; //Skip past end of string and \0 terminator
 	}
-	return 0;
+	if (p==NULL) return 0;
+	//Copy from p to end
+	while (*p!=0 && retLen>1) {
+		*ret++=*p++;
+		retLen--;
+	}
+	//Zero-terminate string
+	*ret=0;
+	return 1;
 }
 
 //Call before calling httpdStartResponse to disable automatically-chosen transfer
@@ -228,7 +313,15 @@ void ICACHE_FLASH_ATTR httpdSetSendBuffer(HttpdConnData *conn, char *buff, short
   conn->priv->sendBuffMax = max;
 }
 
-//Start the response headers.
+//Setup the send buffer reserved for the connection's slot. Use this to send on a connection
+//from outside of the httpd callbacks.
+void ICACHE_FLASH_ATTR httpdSetConnSendBuffer(HttpdConnData *conn)
+{
+  httpdSetSendBuffer(conn, sendBuffPool+conn->slot*MAX_SENDBUFF_LEN, MAX_SENDBUFF_LEN);
+}
+
+//Start the response headers. The framing headers (Content-Length, chunked or
+//Connection: close) are decided in httpdEndHeaders once all headers are known.
 void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
 	char buff[256];
 	int l;
@@ -236,25 +329,38 @@ void ICACHE_FLASH_ATTR httpdStartResponse(HttpdConnData *conn, int code) {
 			(conn->priv->flags&HFL_HTTP11)?1:0, 
 			code);
 	httpdSend(conn, buff, l);
-    if (code != 101) {
-	    l=sprintf(buff, "%s\r\n", 
-			    (conn->priv->flags&HFL_CHUNKED)?"Transfer-Encoding: chunked":"Connection: close");
-	    httpdSend(conn, buff, l);
-    }
+	if (code==101) conn->priv->flags|=HFL_UPGRADE;
 }
 
 //Send a http header.
 void ICACHE_FLASH_ATTR httpdHeader(HttpdConnData *conn, const char *field, const char *val) {
+	//A response with a known length doesn't need chunking to stay alive.
+	if (strcasecmp(field, "Content-Length")==0) conn->priv->flags|=HFL_CONTENTLEN;
 	httpdSend(conn, field, -1);
 	httpdSend(conn, ": ", -1);
 	httpdSend(conn, val, -1);
 	httpdSend(conn, "\r\n", -1);
 }
 
-//Finish the headers.
+//Finish the headers. Picks the framing for the body: a response with a Content-Length
+//or a chunked one can leave the connection open for the next request if the client
+//allows it, anything else is delimited by closing the connection.
 void ICACHE_FLASH_ATTR httpdEndHeaders(HttpdConnData *conn) {
+	int flags=conn->priv->flags;
+	if (!(flags&HFL_UPGRADE)) {
+		if (flags&HFL_CONTENTLEN) {
+			flags&=~HFL_CHUNKED;
+			if (flags&HFL_KEEPALIVE) flags|=HFL_PERSIST;
+			else httpdSend(conn, "Connection: close\r\n", -1);
+		} else if (flags&HFL_CHUNKED) {
+			httpdSend(conn, "Transfer-Encoding: chunked\r\n", -1);
+			if (flags&HFL_KEEPALIVE) flags|=HFL_PERSIST;
+		} else {
+			httpdSend(conn, "Connection: close\r\n", -1);
+		}
+	}
 	httpdSend(conn, "\r\n", -1);
-	conn->priv->flags|=HFL_SENDINGBODY;
+	conn->priv->flags=flags|HFL_SENDINGBODY;
 }
 
 //Redirect to the given URL.
@@ -315,7 +421,7 @@ int ICACHE_FLASH_ATTR cgiRedirectToHostname(HttpdConnData *connData) {
 	//Check hostname; pass on if the same
 	if (strcmp(connData->hostName, (char*)connData->cgiArg)==0) return HTTPD_CGI_NOTFOUND;
 	//Not the same. Redirect to real hostname.
-	buff=malloc(strlen((char*)connData->cgiArg)+sizeof(hostFmt));
+	buff=httpdMalloc(strlen((char*)connData->cgiArg)+sizeof(hostFmt));
 	sprintf(buff, hostFmt, (char*)connData->cgiArg);
 	httpd_printf("Redirecting to hostname url %s\n", buff);
 	httpdRedirect(connData, buff);
@@ -354,12 +460,16 @@ int ICACHE_FLASH_ATTR httpdSend(HttpdConnData *conn, const char *data, int len)
 	if (conn->conn==NULL) return 0;
 	if (len<0) len=strlen(data);
 	if (len==0) return 1;
-	if (conn->priv->flags&HFL_CHUNKED && conn->priv->flags&HFL_SENDINGBODY && conn->priv->chunkHdr==NULL) {
-		if (conn->priv->sendBuffLen+len+6>conn->priv->sendBuffMax) return 0;
-		//Establish start of chunk
-		conn->priv->chunkHdr=&conn->priv->sendBuff[conn->priv->sendBuffLen];
-		strcpy(conn->priv->chunkHdr, "0000\r\n");
-		conn->priv->sendBuffLen+=6;
+	if (conn->priv->flags&HFL_CHUNKED && conn->priv->flags&HFL_SENDINGBODY) {
+		//Keep room for the chunk trailer and the terminating zero-length chunk
+		//httpdFlushSendBuffer adds.
+		if (conn->priv->sendBuffLen+len+(conn->priv->chunkHdr==NULL?6:0)+CHUNK_TRAILER_LEN>conn->priv->sendBuffMax) return 0;
+		if (conn->priv->chunkHdr==NULL) {
+			//Establish start of chunk
+			conn->priv->chunkHdr=&conn->priv->sendBuff[conn->priv->sendBuffLen];
+			memcpy(conn->priv->chunkHdr, "0000\r\n", 6);
+			conn->priv->sendBuffLen+=6;
+		}
 	}
 	if (conn->priv->sendBuffLen+len>conn->priv->sendBuffMax) return 0;
 	memcpy(conn->priv->sendBuff+conn->priv->sendBuffLen, data, len);
@@ -376,13 +486,15 @@ static char ICACHE_FLASH_ATTR httpdHexNibble(int val) {
 //Function to send any data in conn->priv->sendBuff. Do not use in CGIs unless you know what you
 //are doing! Also, if you do set conn->cgi to NULL to indicate the connection is closed, do it BEFORE
 //calling this.
-void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdConnData *conn) {
-	int len;
-	if (conn->conn==NULL) return;
+//Returns 1 if the data was sent or queued, 0 if it was dropped because the backlog is full.
+int ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdConnData *conn) {
+	int len, r;
+	if (conn->conn==NULL) return 0;
 	if (conn->priv->chunkHdr!=NULL) {
 		//We're sending chunked data, and the chunk needs fixing up.
-		//Finish chunk with cr/lf
-		httpdSend(conn, "\r\n", 2);
+		//Finish chunk with cr/lf. Room for this was reserved by httpdSend.
+		memcpy(&conn->priv->sendBuff[conn->priv->sendBuffLen], "\r\n", 2);
+		conn->priv->sendBuffLen+=2;
 		//Calculate length of chunk
 		len=((&conn->priv->sendBuff[conn->priv->sendBuffLen])-conn->priv->chunkHdr)-8;
 		//Fix up chunk header to correct value
@@ -395,65 +507,119 @@ void ICACHE_FLASH_ATTR httpdFlushSendBuffer(HttpdConnData *conn) {
 	}
 	if (conn->priv->flags&HFL_CHUNKED && conn->priv->flags&HFL_SENDINGBODY && conn->cgi==NULL) {
 		//Connection finished sending whatever needs to be sent. Add NULL chunk to indicate this.
-		strcpy(&conn->priv->sendBuff[conn->priv->sendBuffLen], "0\r\n\r\n");
+		memcpy(&conn->priv->sendBuff[conn->priv->sendBuffLen], "0\r\n\r\n", 5);
 		conn->priv->sendBuffLen+=5;
 	}
-	if (!httpdUnbufferedSend(conn, conn->priv->sendBuff, conn->priv->sendBuffLen)) {
-	    httpd_printf("Httpd: UnbufferedSend failed!\n");
+	r=httpdUnbufferedSend(conn, conn->priv->sendBuff, conn->priv->sendBuffLen);
+	if (!r) {
+	    httpd_printf("Httpd: UnbufferedSend failed, dropped %d bytes!\n", conn->priv->sendBuffLen);
 	}
 	conn->priv->sendBuffLen=0;
+	return r;
 }
 
+//Send data now or, if the socket is busy, queue it in the backlog. Data is never queued partially:
+//if it doesn't fit in the backlog nothing is queued and 0 is returned, so the caller can try again
+//after the backlog drained.
 int ICACHE_FLASH_ATTR httpdUnbufferedSend(HttpdConnData *conn, const char *data, int len) {
-	if (len!=0) {
-		if (!httpdPlatSendData(conn->conn, data, len)) {
-		    httpd_printf("Httpd: queuing %d byte buffer\n", len);
-			//Can't send this for some reason. Dump packet in backlog, we can send it later.
-			if (conn->priv->sendBacklogSize+len>MAX_BACKLOG_SIZE) {
-				httpd_printf("Httpd: Backlog: Exceeded max backlog size, dropped %d bytes instead of sending them.\n", len);
-				return 0;
-			}
-			HttpSendBacklogItem *i=malloc(sizeof(HttpSendBacklogItem)+len);
-			if (i==NULL) {
-				httpd_printf("Httpd: Backlog: malloc failed, out of memory!\n");
-				return 0;
-			}
-			memcpy(i->data, data, len);
-			i->len=len;
-			i->next=NULL;
-			if (conn->priv->sendBacklog==NULL) {
-				conn->priv->sendBacklog=i;
-			} else {
-				HttpSendBacklogItem *e=conn->priv->sendBacklog;
-				while (e->next!=NULL) e=e->next;
-				e->next=i;
-			}
-			conn->priv->sendBacklogSize+=len;
+	HttpdPriv *priv=conn->priv;
+	int tail, n;
+	if (len==0) return 1;
+	//Anything already queued has to go out first.
+	if (priv->sendBacklogSize==0 && httpdPlatSendData(conn->conn, data, len)) return 1;
+	//Can't send this for some reason. Put it in the backlog, we can send it later.
+	if (priv->sendBacklogSize+len>MAX_BACKLOG_SIZE) {
+		httpd_printf("Httpd: Backlog: %d bytes don't fit, %d free.\n", len, MAX_BACKLOG_SIZE-priv->sendBacklogSize);
+		return 0;
+	}
+	if (priv->sendBacklog==NULL) {
+		priv->sendBacklog=httpdMalloc(MAX_BACKLOG_SIZE);
+		if (priv->sendBacklog==NULL) {
+			httpd_printf("Httpd: Backlog: malloc failed, out of memory!\n");
+			return 0;
 		}
+		priv->sendBacklogHead=0;
 	}
+	httpd_printf("Httpd: queuing %d byte buffer\n", len);
+	//Copy in at the tail, wrapping around the end of the ring if needed.
+	tail=(priv->sendBacklogHead+priv->sendBacklogSize)%MAX_BACKLOG_SIZE;
+	n=MAX_BACKLOG_SIZE-tail;
+	if (n>len) n=len;
+	memcpy(priv->sendBacklog+tail, data, n);
+	memcpy(priv->sendBacklog, data+n, len-n);
+	priv->sendBacklogSize+=len;
 	return 1;
 }
 
+//Send the next piece of the backlog: what's queued up to the end of the ring, at most one TCP segment.
+//Only called from the sent callback.
+static void ICACHE_FLASH_ATTR httpdSendBacklog(HttpdConnData *conn) {
+	HttpdPriv *priv=conn->priv;
+	int len=priv->sendBacklogSize;
+	if (len>MAX_BACKLOG_SIZE-priv->sendBacklogHead) len=MAX_BACKLOG_SIZE-priv->sendBacklogHead;
+	if (len>BACKLOG_SEGMENT_LEN) len=BACKLOG_SEGMENT_LEN;
+	httpd_printf("Httpd: sending %d byte queued buffer\n", len);
+	if (!httpdPlatSendData(conn->conn, priv->sendBacklog+priv->sendBacklogHead, len)) {
+		//Nothing is in flight, so no sent callback will come to try again. Give up on the
+		//connection rather than leave it and its CGI stalled until the timeout.
+		httpd_printf("Httpd: Backlog: send failed, closing with %d bytes queued\n", priv->sendBacklogSize);
+		httpdPlatDisconnect(conn->conn);
+		return;
+	}
+	priv->sendBacklogHead=(priv->sendBacklogHead+len)%MAX_BACKLOG_SIZE;
+	priv->sendBacklogSize-=len;
+	if (priv->sendBacklogSize==0) {
+		//Idle connections shouldn't hold on to the ring.
+		free(priv->sendBacklog);
+		priv->sendBacklog=NULL;
+	}
+}
+
 void ICACHE_FLASH_ATTR httpdCgiIsDone(HttpdConnData *conn) {
+	//Already cleaned up for the next request; happens when a CGI calls this itself
+	//and then returns HTTPD_CGI_DONE.
+	if (conn->cgi==NULL && conn->post->len<0) return;
 	conn->cgi=NULL; //no need to call this anymore
-	if (conn->priv->flags&HFL_CHUNKED) {
+	//Only keep the connection if the response was framed, no POST data is left unread
+	//and all of the response could be sent. Otherwise the rest of the body would be
+	//parsed as the next request, or the client would wait for the missing bytes.
+	if (conn->priv->flags&HFL_PERSIST && conn->post->received>=conn->post->len && httpdFlushSendBuffer(conn)) {
 		httpd_printf("Pool slot %d is done. Cleaning up for next req\n", conn->slot);
-		httpdFlushSendBuffer(conn);
 		//Note: Do not clean up sendBacklog, it may still contain data at this point.
 		conn->priv->headPos=0;
+		conn->priv->lineStart=0;
+		conn->priv->lineLen=0;
+		conn->priv->hdrStart=0;
+		conn->priv->postLen=0;
+		memset(conn->priv->hdrValue, 0, sizeof(conn->priv->hdrValue));
+		conn->priv->chunkHdr=NULL;
 		conn->post->len=-1;
 		conn->priv->flags=0;
 		if (conn->post->buff) free(conn->post->buff);
 		conn->post->buff=NULL;
+		conn->post->buffSize=0;
 		conn->post->buffLen=0;
 		conn->post->received=0;
+		conn->post->multipartBoundary=NULL;
 		conn->hostName=NULL;
+		conn->url=NULL;
+		conn->getArgs=NULL;
+		conn->cgiData=NULL;
+		conn->cgiArg=NULL;
+		conn->recvHdl=NULL;
 	} else {
 		//Cannot re-use this connection. Mark to get it killed after all data is sent.
 		conn->priv->flags|=HFL_DISCONAFTERSENT;
 	}
 }
 
+//Flush what a CGI sent from one of the httpd callbacks. If it had to be dropped the response
+//now has a hole in it, so don't let the CGI continue it: close the connection once the
+//backlog has been sent.
+static void ICACHE_FLASH_ATTR httpdFlushCgiSendBuffer(HttpdConnData *conn) {
+	if (!httpdFlushSendBuffer(conn)) conn->priv->flags|=HFL_DISCONAFTERSENT;
+}
+
 // store the cgi callback reason and call the user's function
 static int ICACHE_FLASH_ATTR callCGI(HttpdConnData *connData, int reason, int value) {
     connData->cgiReason = reason;
@@ -466,22 +632,15 @@ static int ICACHE_FLASH_ATTR callCGI(HttpdConnData *connData, int reason, int va
 void ICACHE_FLASH_ATTR httpdSentCb(ConnTypePtr rconn, char *remIp, int remPort) {
 	int r;
 	HttpdConnData *conn=rconn->reverse;
-	char *sendBuff;
 
 	if (conn==NULL) return;
 
-	if (conn->priv->sendBacklog!=NULL) {
-	    httpd_printf("Httpd: sending %d byte queued buffer\n", conn->priv->sendBacklog->len);
-		//We have some backlog to send first.
-		HttpSendBacklogItem *next=conn->priv->sendBacklog->next;
-		httpdPlatSendData(conn->conn, conn->priv->sendBacklog->data, conn->priv->sendBacklog->len);
-		conn->priv->sendBacklogSize-=conn->priv->sendBacklog->len;
-		free(conn->priv->sendBacklog);
-		conn->priv->sendBacklog=next;
+	if (conn->priv->sendBacklogSize!=0) {
+		//We have some backlog to send first. The CGI is only called again once it has all
+		//been sent, so CGI_CB_SENT means everything the CGI sent so far is out.
+		httpdSendBacklog(conn);
 		return;
-	}
-
-	if (conn->priv->flags&HFL_DISCONAFTERSENT) { //Marked for destruction?
+	} else if (conn->priv->flags&HFL_DISCONAFTERSENT) { //Marked for destruction?
 		httpd_printf("Pool slot %d is done. Closing.\n", conn->slot);
 		httpdPlatDisconnect(conn->conn);
 		return; //No need to call httpdFlushSendBuffer.
@@ -490,10 +649,7 @@ void ICACHE_FLASH_ATTR httpdSentCb(ConnTypePtr rconn, char *remIp, int remPort)
 	//If we don't have a CGI function, there's nothing to do but wait for something from the client.
 	if (conn->cgi==NULL) return;
 
-	sendBuff=malloc(MAX_SENDBUFF_LEN);
-	conn->priv->sendBuff=sendBuff;
-	conn->priv->sendBuffLen=0;
-    conn->priv->sendBuffMax = MAX_SENDBUFF_LEN;
+	httpdSetConnSendBuffer(conn);
 
 	r=callCGI(conn, CGI_CB_SENT, 0); //Execute cgi fn.
 	if (r==HTTPD_CGI_DONE) {
@@ -503,8 +659,70 @@ void ICACHE_FLASH_ATTR httpdSentCb(ConnTypePtr rconn, char *remIp, int remPort)
 		httpd_printf("ERROR! CGI fn returns code %d after sending data! Bad CGI!\n", r);
 		httpdCgiIsDone(conn);
 	}
-	httpdFlushSendBuffer(conn);
-	free(sendBuff);
+	httpdFlushCgiSendBuffer(conn);
+}
+
+//Compile builtInUrls into the route hash tables.
+static void ICACHE_FLASH_ATTR httpdCompileRoutes(void) {
+	int i, n, len;
+	short *bucket;
+	for (i=0; i<ROUTE_HASH_SIZE; i++) routeExact[i]=routeWild[i]=-1;
+	for (n=0; builtInUrls[n].url!=NULL; n++) ;
+	routes=httpdMalloc(n*sizeof(HttpdRoute));
+	if (routes==NULL) {
+		httpd_printf("Httpd: no memory for routes, using linear url lookup\n");
+		return;
+	}
+	//Walk the table backwards so each bucket ends up in table order.
+	for (i=n-1; i>=0; i--) {
+		len=strlen(builtInUrls[i].url);
+		if (len>0 && builtInUrls[i].url[len-1]=='*') {
+			routes[i].prefixLen=--len;
+			bucket=routeWild;
+		} else {
+			routes[i].prefixLen=-1;
+			bucket=routeExact;
+		}
+		routes[i].hash=ROUTE_HASH_INIT;
+		for (int j=0; j<len; j++) routes[i].hash=ROUTE_HASH_STEP(routes[i].hash, builtInUrls[i].url[j]);
+		routes[i].next=bucket[routes[i].hash%ROUTE_HASH_SIZE];
+		bucket[routes[i].hash%ROUTE_HASH_SIZE]=i;
+	}
+}
+
+//Returns the index of the first builtInUrls entry after index 'after' that matches the url,
+//or -1 if there is none.
+static int ICACHE_FLASH_ATTR httpdRouteNext(const char *url, int after) {
+	uint32 hash=ROUTE_HASH_INIT;
+	int best=-1;
+	int i, k;
+	if (routes==NULL) {
+		for (i=after+1; builtInUrls[i].url!=NULL; i++) {
+			k=strlen(builtInUrls[i].url)-1;
+			if (strcmp(builtInUrls[i].url, url)==0) return i;
+			if (builtInUrls[i].url[k]=='*' && strncmp(builtInUrls[i].url, url, k)==0) return i;
+		}
+		return -1;
+	}
+	//Hash the url one character at a time, checking the wildcard urls for each prefix.
+	for (k=0; ; k++) {
+		for (i=routeWild[hash%ROUTE_HASH_SIZE]; i>=0 && (best<0 || i<best); i=routes[i].next) {
+			if (i>after && routes[i].prefixLen==k && routes[i].hash==hash &&
+					strncmp(builtInUrls[i].url, url, k)==0) {
+				best=i;
+				break;
+			}
+		}
+		if (url[k]==0) break;
+		hash=ROUTE_HASH_STEP(hash, url[k]);
+	}
+	for (i=routeExact[hash%ROUTE_HASH_SIZE]; i>=0 && (best<0 || i<best); i=routes[i].next) {
+		if (i>after && routes[i].hash==hash && strcmp(builtInUrls[i].url, url)==0) {
+			best=i;
+			break;
+		}
+	}
+	return best;
 }
 
 //This is called when the headers have been received and the connection is ready to send
@@ -513,7 +731,7 @@ void ICACHE_FLASH_ATTR httpdSentCb(ConnTypePtr rconn, char *remIp, int remPort)
 //find the next cgi function, wait till the cgi data is sent or close up the connection.
 static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
 	int r;
-	int i=0;
+	int i=-1;
 	if (conn->url==NULL) {
 		httpd_printf("WtF? url = NULL\n");
 		return; //Shouldn't happen
@@ -521,23 +739,13 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
 	//See if we can find a CGI that's happy to handle the request.
 	while (1) {
 		//Look up URL in the built-in URL table.
-		while (builtInUrls[i].url!=NULL) {
-			int match=0;
-			//See if there's a literal match
-			if (strcmp(builtInUrls[i].url, conn->url)==0) match=1;
-			//See if there's a wildcard match
-			if (builtInUrls[i].url[strlen(builtInUrls[i].url)-1]=='*' &&
-					strncmp(builtInUrls[i].url, conn->url, strlen(builtInUrls[i].url)-1)==0) match=1;
-			if (match) {
-//				httpd_printf("Is url index %d\n", i);
-				conn->cgiData=NULL;
-				conn->cgi=builtInUrls[i].cgiCb;
-				conn->cgiArg=builtInUrls[i].cgiArg;
-				break;
-			}
-			i++;
-		}
-		if (builtInUrls[i].url==NULL) {
+		i=httpdRouteNext(conn->url, i);
+		if (i>=0) {
+//			httpd_printf("Is url index %d\n", i);
+			conn->cgiData=NULL;
+			conn->cgi=builtInUrls[i].cgiCb;
+			conn->cgiArg=builtInUrls[i].cgiArg;
+		} else {
 			//Drat, we're at the end of the URL table. This usually shouldn't happen. Well, just
 			//generate a built-in 404 to handle this.
 			httpd_printf("%s not found. 404!\n", conn->url);
@@ -554,7 +762,7 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
 				//Disable the timeout on it, so we won't run into that.
 				httpdPlatDisableTimeout(conn->conn);
 			}
-			httpdFlushSendBuffer(conn);
+			httpdFlushCgiSendBuffer(conn);
 			return;
 		} else if (r==HTTPD_CGI_DONE) {
 			//Yep, it's happy to do so and already is done sending data.
@@ -562,103 +770,130 @@ static void ICACHE_FLASH_ATTR httpdProcessRequest(HttpdConnData *conn) {
 			return;
 		} else if (r==HTTPD_CGI_NOTFOUND || r==HTTPD_CGI_AUTHENTICATED) {
 			//URL doesn't want to handle the request: either the data isn't found or there's no
-			//need to generate a login screen.
-			i++; //look at next url the next iteration of the loop.
+			//need to generate a login screen. Look at the next matching url the next iteration
+			//of the loop.
 		}
 	}
 }
 
-//Parse a line of header data and modify the connection data accordingly.
-static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
+//Parse the request line of the head and modify the connection data accordingly.
+static void ICACHE_FLASH_ATTR httpdParseRequestLine(char *h, HttpdConnData *conn) {
 	int i;
-	char firstLine=0;
-	
+	char *e;
+
 	if (strncmp(h, "GET ", 4)==0) {
 		conn->requestType = HTTPD_METHOD_GET;
-		firstLine=1;
-	} else if (strncmp(h, "Host:", 5)==0) {
-		i=5;
-		while (h[i]==' ') i++;
-		conn->hostName=&h[i];
 	} else if (strncmp(h, "POST ", 5)==0) {
 		conn->requestType = HTTPD_METHOD_POST;
-		firstLine=1;
+	} else {
+		return;
 	}
 
-	if (firstLine) {
-		char *e;
-		
-		//Skip past the space after POST/GET
-		i=0;
-		while (h[i]!=' ') i++;
-		conn->url=h+i+1;
-
-		//Figure out end of url.
-		e=(char*)strstr(conn->url, " ");
-		if (e==NULL) return; //wtf?
-		*e=0; //terminate url part
-		e++; //Skip to protocol indicator
-		while (*e==' ') e++; //Skip spaces.
-		//If HTTP/1.1, note that and set chunked encoding
-		if (strcasecmp(e, "HTTP/1.1")==0) conn->priv->flags|=HFL_HTTP11; // BUG -- dbetz |HFL_CHUNKED;
-
-		httpd_printf("URL = %s\n", conn->url);
-		//Parse out the URL part before the GET parameters.
-		conn->getArgs=(char*)strstr(conn->url, "?");
-		if (conn->getArgs!=0) {
-			*conn->getArgs=0;
-			conn->getArgs++;
-			httpd_printf("GET args = %s\n", conn->getArgs);
-		} else {
-			conn->getArgs=NULL;
-		}
-	} else if (strncmp(h, "Connection:", 11)==0) {
-		i=11;
-		//Skip trailing spaces
-		while (h[i]==' ') i++;
-		if (strncmp(&h[i], "close", 5)==0) conn->priv->flags&=~HFL_CHUNKED; //Don't use chunked conn
-	} else if (strncmp(h, "Content-Length:", 15)==0) {
-		i=15;
-		//Skip trailing spaces
-		while (h[i]==' ') i++;
-		//Get POST data length
-		conn->post->len=atoi(h+i);
-
-		// Allocate the buffer
-		if (conn->post->len > MAX_POST) {
-			// we'll stream this in in chunks
-			conn->post->buffSize = MAX_POST;
-		} else {
-			conn->post->buffSize = conn->post->len;
-		}
-		httpd_printf("Mallocced buffer for %d + 1 bytes of post data.\n", conn->post->buffSize);
-		conn->post->buff=(char*)malloc(conn->post->buffSize + 1);
-		conn->post->buffLen=0;
-	} else if (strncmp(h, "Content-Type: ", 14)==0) {
-		if (strstr(h, "multipart/form-data")) {
+	//Skip past the space after POST/GET
+	i=0;
+	while (h[i]!=' ') i++;
+	conn->url=h+i+1;
+
+	//Figure out end of url.
+	e=(char*)strstr(conn->url, " ");
+	if (e==NULL) return; //wtf?
+	*e=0; //terminate url part
+	e++; //Skip to protocol indicator
+	while (*e==' ') e++; //Skip spaces.
+	//If HTTP/1.1, note that and set chunked encoding. HTTP/1.1 connections are
+	//persistent unless the client says otherwise.
+	if (strcasecmp(e, "HTTP/1.1")==0) conn->priv->flags|=HFL_HTTP11|HFL_CHUNKED|HFL_KEEPALIVE;
+
+	httpd_printf("URL = %s\n", conn->url);
+	//Parse out the URL part before the GET parameters.
+	conn->getArgs=(char*)strstr(conn->url, "?");
+	if (conn->getArgs!=0) {
+		*conn->getArgs=0;
+		conn->getArgs++;
+		httpd_printf("GET args = %s\n", conn->getArgs);
+	} else {
+		conn->getArgs=NULL;
+	}
+}
+
+//Parse a header line, remember where its value is if it's one of the indexed headers
+//and modify the connection data accordingly.
+static void ICACHE_FLASH_ATTR httpdParseHeader(char *h, HttpdConnData *conn) {
+	char *v=strchr(h, ':');
+	int id;
+
+	if (v==NULL) return;
+	id=httpdHeaderId(h, v-h);
+	if (id<0) return;
+	//Skip past the colon and the spaces after it
+	v++;
+	while (*v==' ') v++;
+	conn->priv->hdrValue[id]=v-conn->priv->head;
+
+	switch (id) {
+	case HDR_HOST:
+		conn->hostName=v;
+		break;
+	case HDR_CONNECTION:
+		if (strncasecmp(v, "close", 5)==0) conn->priv->flags&=~(HFL_CHUNKED|HFL_KEEPALIVE); //Don't use chunked conn
+		break;
+	case HDR_CONTENT_LENGTH:
+		//Get POST data length; the buffer is allocated once the head is complete.
+		conn->priv->postLen=atoi(v);
+		break;
+	case HDR_CONTENT_TYPE:
+		if (strstr(v, "multipart/form-data")) {
 			// It's multipart form data so let's pull out the boundary for future use
 			char *b;
-			if ((b = strstr(h, "boundary=")) != NULL) {
+			if ((b = strstr(v, "boundary=")) != NULL) {
 				conn->post->multipartBoundary = b + 7; // move the pointer 2 chars before boundary then fill them with dashes
 				conn->post->multipartBoundary[0] = '-';
 				conn->post->multipartBoundary[1] = '-';
 				httpd_printf("boundary = %s\n", conn->post->multipartBoundary);
 			}
 		}
+		break;
 	}
 }
 
+//Feed one byte of the request head to the parser. Each line is zero-terminated in priv->head
+//and parsed as soon as its end is seen, so the head is only looked at once. Returns 1 when the
+//empty line that ends the head has been received.
+static int ICACHE_FLASH_ATTR httpdParseHeadByte(HttpdConnData *conn, char c) {
+	HttpdPriv *priv=conn->priv;
+	char *line;
+
+	//Lines end at the \n, with or without a \r in front of it.
+	if (c=='\r') return 0;
+	if (c!='\n') {
+		//ToDo: return http error code 431 (request header too long) if this happens
+		//Keep room for the terminator; overlong lines are cut short.
+		if (priv->headPos<MAX_HEAD_LEN-1) priv->head[priv->headPos++]=c;
+		priv->lineLen++;
+		return 0;
+	}
+	//An empty line ends the head. Ignore empty lines before the request line.
+	if (priv->lineLen==0) return (priv->hdrStart!=0);
+	line=&priv->head[priv->lineStart];
+	priv->head[priv->headPos]=0;
+	if (priv->headPos<MAX_HEAD_LEN-1) priv->headPos++;
+	priv->lineStart=priv->headPos;
+	priv->lineLen=0;
+	if (priv->hdrStart==0) {
+		priv->hdrStart=priv->headPos;
+		httpdParseRequestLine(line, conn);
+	} else {
+		httpdParseHeader(line, conn);
+	}
+	return 0;
+}
 
 //Callback called when there's data available on a socket.
 void ICACHE_FLASH_ATTR httpdRecvCb(ConnTypePtr rconn, char *remIp, int remPort, char *data, unsigned short len) {
 	int x, r;
-	char *p, *e;
-	char *sendBuff=malloc(MAX_SENDBUFF_LEN);
 	HttpdConnData *conn=rconn->reverse;
 	if (conn==NULL) return;
-	conn->priv->sendBuff=sendBuff;
-	conn->priv->sendBuffLen=0;
-    conn->priv->sendBuffMax = MAX_SENDBUFF_LEN;
+	httpdSetConnSendBuffer(conn);
 
 	//This is slightly evil/dirty: we abuse conn->post->len as a state variable for where in the http communications we are:
 	//<0 (-1): Post len unknown because we're still receiving headers
@@ -669,29 +904,29 @@ void ICACHE_FLASH_ATTR httpdRecvCb(ConnTypePtr rconn, char *remIp, int remPort,
 	for (x=0; x<len; x++) {
 		if (conn->post->len<0) {
 			//This byte is a header byte.
-			if (data[x]=='\n') {
-				//Compatibility with clients that send \n only: fake a \r in front of this.
-				if (conn->priv->headPos!=0 && conn->priv->head[conn->priv->headPos-1]!='\r') {
-					conn->priv->head[conn->priv->headPos++]='\r';
-				}
-			}
-			//ToDo: return http error code 431 (request header too long) if this happens
-			if (conn->priv->headPos!=MAX_HEAD_LEN) conn->priv->head[conn->priv->headPos++]=data[x];
-			conn->priv->head[conn->priv->headPos]=0;
-			//Scan for /r/n/r/n. Receiving this indicate the headers end.
-			if (data[x]=='\n' && (char *)strstr(conn->priv->head, "\r\n\r\n")!=NULL) {
+			if (httpdParseHeadByte(conn, data[x])) {
 				//Indicate we're done with the headers.
-				conn->post->len=0;
-				//Reset url data
-				conn->url=NULL;
-				//Iterate over all received headers and parse them.
-				p=conn->priv->head;
-				while(p<(&conn->priv->head[conn->priv->headPos-4])) {
-					e=(char *)strstr(p, "\r\n"); //Find end of header line
-					if (e==NULL) break;			//Shouldn't happen.
-					e[0]=0;						//Zero-terminate header
-					httpdParseHeader(p, conn);	//and parse it.
-					p=e+2;						//Skip /r/n (now /0/n)
+				conn->post->len=conn->priv->postLen;
+				if (conn->post->len>0) {
+					// Allocate the buffer
+					if (conn->post->len > MAX_POST) {
+						// we'll stream this in in chunks
+						conn->post->buffSize = MAX_POST;
+					} else {
+						conn->post->buffSize = conn->post->len;
+					}
+					httpd_printf("Mallocced buffer for %d + 1 bytes of post data.\n", conn->post->buffSize);
+					conn->post->buff=(char*)httpdMalloc(conn->post->buffSize + 1);
+					conn->post->buffLen=0;
+					if (conn->post->buff==NULL) {
+						//Out of memory: refuse the request and close once that's sent.
+						conn->post->len=0;
+						conn->priv->flags&=~(HFL_CHUNKED|HFL_KEEPALIVE);
+						httpdStartResponse(conn, 500);
+						httpdEndHeaders(conn);
+						conn->priv->flags|=HFL_DISCONAFTERSENT;
+						break;
+					}
 				}
 				//If we don't need to receive post data, we can send the response now.
 				if (conn->post->len==0) {
@@ -734,8 +969,7 @@ void ICACHE_FLASH_ATTR httpdRecvCb(ConnTypePtr rconn, char *remIp, int remPort,
 			}
 		}
 	}
-	if (conn->conn) httpdFlushSendBuffer(conn);
-	free(sendBuff);
+	if (conn->conn) httpdFlushCgiSendBuffer(conn);
 }
 
 //The platform layer should ALWAYS call this function, regardless if the connection is closed by the server
@@ -761,6 +995,8 @@ void ICACHE_FLASH_ATTR httpdReconCb(ConnTypePtr rconn, char *remIp, int remPort,
 
 int ICACHE_FLASH_ATTR httpdConnectCb(ConnTypePtr conn, char *remIp, int remPort) {
 	int i;
+	//Without send buffers there's no way to answer.
+	if (sendBuffPool==NULL) return 0;
 	//Find empty conndata in pool
 	for (i=0; i<HTTPD_MAX_CONNECTIONS; i++) if (connData[i]==NULL) break;
 	httpd_printf("Conn req from  %d.%d.%d.%d:%d, using pool slot %d\n", remIp[0]&0xff, remIp[1]&0xff, remIp[2]&0xff, remIp[3]&0xff, remPort, i);
@@ -768,15 +1004,24 @@ int ICACHE_FLASH_ATTR httpdConnectCb(ConnTypePtr conn, char *remIp, int remPort)
 		httpd_printf("Aiee, conn pool overflow!\n");
 		return 0;
 	}
-	connData[i]=malloc(sizeof(HttpdConnData));
+	connData[i]=httpdMalloc(sizeof(HttpdConnData));
+	if (connData[i]==NULL) return 0;
 	memset(connData[i], 0, sizeof(HttpdConnData));
-	connData[i]->priv=malloc(sizeof(HttpdPriv));
+	connData[i]->priv=httpdMalloc(sizeof(HttpdPriv));
+	connData[i]->post=httpdMalloc(sizeof(HttpdPostData));
+	if (connData[i]->priv==NULL || connData[i]->post==NULL) {
+		httpd_printf("Out of memory for pool slot %d\n", i);
+		if (connData[i]->priv) free(connData[i]->priv);
+		if (connData[i]->post) free(connData[i]->post);
+		free(connData[i]);
+		connData[i]=NULL;
+		return 0;
+	}
 	memset(connData[i]->priv, 0, sizeof(HttpdPriv));
 	connData[i]->conn=conn;
 	conn->reverse = connData[i];
 	connData[i]->slot=i;
 	connData[i]->priv->headPos=0;
-	connData[i]->post=malloc(sizeof(HttpdPostData));
 	memset(connData[i]->post, 0, sizeof(HttpdPostData));
 	connData[i]->post->buff=NULL;
 	connData[i]->post->buffLen=0;
@@ -785,6 +1030,7 @@ int ICACHE_FLASH_ATTR httpdConnectCb(ConnTypePtr conn, char *remIp, int remPort)
 	connData[i]->hostName=NULL;
 	connData[i]->remote_port=remPort;
 	connData[i]->priv->sendBacklog=NULL;
+	connData[i]->priv->sendBacklogHead=0;
 	connData[i]->priv->sendBacklogSize=0;
 	memcpy(connData[i]->remote_ip, remIp, 4);
 
@@ -799,6 +1045,11 @@ void ICACHE_FLASH_ATTR httpdInit(HttpdBuiltInUrl *fixedUrls, int port) {
 		connData[i]=NULL;
 	}
 	builtInUrls=fixedUrls;
+	httpdCompileRoutes();
+	sendBuffPool=httpdMalloc(HTTPD_MAX_CONNECTIONS*MAX_SENDBUFF_LEN);
+	if (sendBuffPool==NULL) {
+		httpd_printf("Httpd: no memory for send buffers, refusing connections\n");
+	}
 
 	httpdPlatInit(port, HTTPD_MAX_CONNECTIONS);
 	httpd_printf("Httpd init\n");
@@ -66,6 +66,8 @@ int ICACHE_FLASH_ATTR cgiEspFsHook(HttpdConnData *connData) {
 		connData->cgiData=file;
 		httpdStartResponse(connData, 200);
 		httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+		sprintf(buff, "%d", espFsSize(file));
+		httpdHeader(connData, "Content-Length", buff);
 		if (isGzip) {
 			httpdHeader(connData, "Content-Encoding", "gzip");
 		}
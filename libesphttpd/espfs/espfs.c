@@ -124,6 +124,18 @@ int ICACHE_FLASH_ATTR espFsFlags(EspFsFile *fh) {
 	return (int)flags;
 }
 
+// Returns the uncompressed size of an opened file.
+int ICACHE_FLASH_ATTR espFsSize(EspFsFile *fh) {
+	int len;
+	if (fh == NULL) return -1;
+	if (fh->decompressor==COMPRESS_NONE) {
+		readFlashUnaligned((char*)&len, (char*)&fh->header->fileLenComp, 4);
+	} else {
+		readFlashUnaligned((char*)&len, (char*)&fh->header->fileLenDecomp, 4);
+	}
+	return len;
+}
+
 //Open a file and return a pointer to the file desc struct.
 EspFsFile ICACHE_FLASH_ATTR *espFsOpen(char *fileName) {
 	if (espFsData == NULL) {
@@ -16,6 +16,7 @@ typedef struct EspFsFile EspFsFile;
 EspFsInitResult espFsInit(void *flashAddress);
 EspFsFile *espFsOpen(char *fileName);
 int espFsFlags(EspFsFile *fh);
+int espFsSize(EspFsFile *fh);
 int espFsRead(EspFsFile *fh, char *buff, int len);
 void espFsClose(EspFsFile *fh);
 
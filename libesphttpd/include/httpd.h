@@ -56,6 +56,15 @@ struct HttpdPostData {
 	char *multipartBoundary; //Text of the multipart boundary, if any
 };
 
+//Heap usage of the server, for spotting fragmentation under load.
+typedef struct {
+	uint32 mallocs;			// Heap allocations made by the server
+	uint32 mallocFailures;	// Heap allocations that failed
+	uint32 minFreeHeap;		// Lowest free heap seen right after a server allocation
+} HttpdStats;
+
+extern HttpdStats httpdStats;
+
 //A struct describing an url. This is the main struct that's used to send different URL requests to
 //different routines.
 typedef struct {
@@ -80,7 +89,8 @@ int httpdGetHeader(HttpdConnData *conn, char *header, char *ret, int retLen);
 int httpdSend(HttpdConnData *conn, const char *data, int len);
 int httpdUnbufferedSend(HttpdConnData *conn, const char *data, int len);
 void httpdSetSendBuffer(HttpdConnData *conn, char *buff, short max);
-void httpdFlushSendBuffer(HttpdConnData *conn);
+void httpdSetConnSendBuffer(HttpdConnData *conn);
+int httpdFlushSendBuffer(HttpdConnData *conn);
 void httpdCgiIsDone(HttpdConnData *conn);
 
 //Platform dependent code should call these.
@@ -108,32 +108,33 @@ static int ICACHE_FLASH_ATTR sendFrameHead(Websock *ws, int opcode, int len) {
 	return httpdSend(ws->conn, buf, i);
 }
 
+//Returns 1 if the frame was sent or queued, 0 if it didn't fit in the send buffer or the
+//connection's backlog is full. Nothing of the frame is sent in that case.
 int ICACHE_FLASH_ATTR cgiWebsocketSend(Websock *ws, char *data, int len, int flags) {
-	int r=0;
+	int r;
 	int fl=0;
 	if (flags&WEBSOCK_FLAG_BIN) fl=OPCODE_BINARY; else fl=OPCODE_TEXT;
 	if (!(flags&WEBSOCK_FLAG_CONT)) fl|=FLAG_FIN;
-	sendFrameHead(ws, fl, len);
-	if (len!=0) r=httpdSend(ws->conn, data, len);
-	httpdFlushSendBuffer(ws->conn);
-	return r;
+	r=sendFrameHead(ws, fl, len);
+	if (r && len!=0) r=httpdSend(ws->conn, data, len);
+	if (!r) {
+		//Don't send a frame head without its payload.
+		httpdSetConnSendBuffer(ws->conn);
+		return 0;
+	}
+	return httpdFlushSendBuffer(ws->conn);
 }
 
 //Broadcast data to all websockets at a specific url. Returns the amount of connections sent to.
 int ICACHE_FLASH_ATTR cgiWebsockBroadcast(char *resource, char *data, int len, int flags) {
-//This is majorly broken (and actually, always, it just tended to work because the circumstances
-//were juuuust right). Because the socket is used outside of the httpd send/receive context, it 
-//will not have an associated send buffer. This means httpdSend will write to a dangling pointer!
-//Disabled for now. If you really need this, open an issue on github or otherwise poke me and I'll
-//see what I can do.
+//The socket is used outside of the httpd send/receive context, so point it at the send buffer
+//reserved for its connection slot before sending.
 	int ret=0;
 #if 1
 	Websock *lw=llStart;
 	while (lw!=NULL) {
-        char sendBuff[1024];
-        httpdSetSendBuffer(lw->conn, sendBuff, sizeof(sendBuff));
-		if (strcmp(lw->conn->url, resource)==0) {
-			cgiWebsocketSend(lw, data, len, flags);
+        httpdSetConnSendBuffer(lw->conn);
+		if (strcmp(lw->conn->url, resource)==0 && cgiWebsocketSend(lw, data, len, flags)) {
 			ret++;
 		}
 		lw=lw->priv->next;
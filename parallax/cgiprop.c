@@ -25,14 +25,16 @@
 #define AUTO_LOAD_PIN       14
 #define AUTO_LOAD_PIN_STATE 0
 
-#define MAX_SENDBUFF_LEN    2600
-
 
 void ICACHE_FLASH_ATTR httpdSendResponse(HttpdConnData *connData, int code, char *message, int len)
 {
-    char sendBuff[MAX_SENDBUFF_LEN];
-    httpdSetSendBuffer(connData, sendBuff, sizeof(sendBuff));
+    char lenBuf[16];
+    if (len < 0)
+        len = strlen(message);
+    httpdSetConnSendBuffer(connData);
     httpdStartResponse(connData, code);
+    os_sprintf(lenBuf, "%d", len);
+    httpdHeader(connData, "Content-Length", lenBuf);
     httpdEndHeaders(connData);
     httpdSend(connData, message, len);
     httpdFlushSendBuffer(connData);
@@ -607,6 +609,9 @@ static void ICACHE_FLASH_ATTR startLoading(PropellerConnection *connection, cons
 
     os_timer_setfn(&connection->timer, timerCallback, connection);
 
+    // the Propeller ROM loader has no handshake lines
+    uart_drain_tx_buffer(UART0);
+    uart0_flow_control(0);
     uart0_config(connection->baudRate, ONE_STOP_BIT);
 
     // makeGpio(connection->resetPin);
@@ -619,6 +624,7 @@ static void ICACHE_FLASH_ATTR finishLoading(PropellerConnection *connection, Loa
 {
     if (connection->finalBaudRate != connection->baudRate);
         uart0_config(connection->finalBaudRate, flashConfig.stop_bits);
+    uart0_flow_control(flashConfig.uart_flow_control);
     if (connection->completionCB)
         (*connection->completionCB)(connection, status);
     programmingCB = NULL;
@@ -627,6 +633,7 @@ static void ICACHE_FLASH_ATTR finishLoading(PropellerConnection *connection, Loa
 
 static void ICACHE_FLASH_ATTR abortLoading(PropellerConnection *connection, LoadStatus status)
 {
+    uart0_flow_control(flashConfig.uart_flow_control);
     if (connection->completionCB)
         (*connection->completionCB)(connection, status);
     programmingCB = NULL;
@@ -87,6 +87,9 @@ cgiRoffsHook(HttpdConnData *connData) {
 		connData->cgiData = file;
 		httpdStartResponse(connData, 200);
 		httpdHeader(connData, "Content-Type", httpdGetMimetype(connData->url));
+		// the body is sent raw so it must be delimited by its length
+		os_sprintf(buff, "%d", roffs_file_size(file));
+		httpdHeader(connData, "Content-Length", buff);
 		if (isGzip) {
 			httpdHeader(connData, "Content-Encoding", "gzip");
 		}
@@ -97,8 +97,15 @@ void ICACHE_FLASH_ATTR cmds_do_listen(int argc, char *argv[])
     else if (os_strcmp(proto, "WS") == 0)
         type = TYPE_WEBSOCKET_LISTENER;
     
-    else if (os_strcmp(proto, "TCP") == 0)
-        type = TYPE_TCP_LISTENER;
+    else if (os_strcmp(proto, "TCP") == 0) {
+        tcp_do_listen(argc, argv);
+        return;
+    }
+    
+    else if (os_strcmp(proto, "UDP") == 0) {
+        udp_do_listen(argc, argv);
+        return;
+    }
     
     else {
         sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
@@ -120,33 +127,117 @@ void ICACHE_FLASH_ATTR cmds_do_listen(int argc, char *argv[])
     sscp_sendResponse("S,%d", listener->hdr.handle);
 }
 
-// POLL
+// POLL[,mask[,max]]
+// with max > 1 up to max events are returned in one reply separated by ';'
 void ICACHE_FLASH_ATTR cmds_do_poll(int argc, char *argv[])
 {
     uint32_t mask;
-    int i;
+    int max, count;
 
-    if (argc < 1 && argc > 2) {
+    if (argc < 1 || argc > 3) {
         sscp_sendResponse("E,%d,0", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
         return;
     }
 
     mask = (argc > 1 ? atoi(argv[1]) : 0xffffffff);
+    max = sscp_beginBatch(argc > 2 ? atoi(argv[2]) : 1);
+
+    for (count = 0; count < max && !sscp_batchFull(); ++count) {
+        if (!sscp_checkForEvents(mask))
+            break;
+    }
+    
+    sscp_endBatch();
+    
+    if (count == 0)
+        sscp_sendResponse("N,0,0");
+}
+
+// longest WAIT in ms: the deadline is in system_get_time microseconds and the time left is
+// taken as a signed 32 bit difference, which only holds for about 2147 seconds
+#define WAIT_TIMEOUT_MAX    2000000
 
-    for (i = 0; i < SSCP_CONNECTION_MAX; ++i) {
-        sscp_hdr *hdr = (sscp_hdr *)&sscp_connections[i];
-        if ((1 << hdr->handle) & mask) {
-            if (hdr->type != TYPE_UNUSED) {
-                if (hdr->dispatch->checkForEvents && (*hdr->dispatch->checkForEvents)(hdr))
-                    return;
-            }
-        }
+static os_timer_t waitTimer;
+static int waitActive = 0;
+static uint32_t waitMask;
+static uint32_t waitDeadline;
+
+// this is called when the WAIT timeout expires and, with no delay, when an event is posted
+static void ICACHE_FLASH_ATTR waitTimerCallback(void *data)
+{
+    int32_t remaining;
+    
+    if (!waitActive)
+        return;
+        
+    if (sscp_checkForEvents(waitMask)) {
+        waitActive = 0;
+        return;
     }
+    
+    remaining = (int32_t)(waitDeadline - system_get_time());
+    if (remaining <= 0) {
+        waitActive = 0;
+        sscp_sendResponse("N,0,0");
+    }
+    else
+        os_timer_arm(&waitTimer, (remaining + 999) / 1000, 0);
+}
 
-    if (wifi_check_for_events())
+// WAIT,timeout-ms[,mask]
+// like POLL but the reply is held until an event arrives or the timeout expires
+void ICACHE_FLASH_ATTR cmds_do_wait(int argc, char *argv[])
+{
+    int timeout;
+    
+    if (argc < 2 || argc > 3) {
+        sscp_sendResponse("E,%d,0", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+        return;
+    }
+    
+    timeout = atoi(argv[1]);
+    waitMask = (argc > 2 ? atoi(argv[2]) : 0xffffffff);
+    
+    if (timeout > WAIT_TIMEOUT_MAX) {
+        sscp_sendResponse("E,%d,0", SSCP_ERROR_INVALID_ARGUMENT);
+        return;
+    }
+    
+    if (sscp_checkForEvents(waitMask))
+        return;
+        
+    if (timeout <= 0) {
+        sscp_sendResponse("N,0,0");
         return;
+    }
     
-    sscp_sendResponse("N,0,0");
+    // response is sent by waitTimerCallback
+    waitActive = 1;
+    waitDeadline = system_get_time() + timeout * 1000;
+    os_timer_disarm(&waitTimer);
+    os_timer_setfn(&waitTimer, waitTimerCallback, NULL);
+    os_timer_arm(&waitTimer, timeout, 0);
+}
+
+// this is called whenever an event is posted
+void ICACHE_FLASH_ATTR cmds_wake_wait(void)
+{
+    // check after the caller has finished updating the connection
+    if (waitActive) {
+        os_timer_disarm(&waitTimer);
+        os_timer_arm(&waitTimer, 0, 0);
+    }
+}
+
+// end a WAIT early, replying as if it had timed out if reply is set
+void ICACHE_FLASH_ATTR cmds_cancel_wait(int reply)
+{
+    if (waitActive) {
+        os_timer_disarm(&waitTimer);
+        waitActive = 0;
+        if (reply)
+            sscp_sendResponse("N,0,0");
+    }
 }
 
 // PATH,chan
@@ -173,6 +264,7 @@ void ICACHE_FLASH_ATTR cmds_do_path(int argc, char *argv[])
 // CLOSE,chan
 void ICACHE_FLASH_ATTR cmds_do_close(int argc, char *argv[])
 {
+    sscp_connection *connection;
     sscp_hdr *hdr;
 
     if (argc != 2) {
@@ -185,9 +277,11 @@ void ICACHE_FLASH_ATTR cmds_do_close(int argc, char *argv[])
         return;
     }
 
-    if (hdr->dispatch->close)
-        (*hdr->dispatch->close)(hdr);
-    hdr->type = TYPE_UNUSED;
+    // connections hand their buffers back to the pool
+    if ((connection = sscp_get_connection(hdr->handle)) != NULL)
+        sscp_close_connection(connection);
+    else
+        sscp_close_listener((sscp_listener *)hdr);
         
     sscp_sendResponse("S,0");
 }
@@ -326,7 +420,7 @@ void ICACHE_FLASH_ATTR cmds_do_send(int argc, char *argv[])
         return;
     }
     
-    if ((count = atoi(argv[2])) < 0 || count > SSCP_TX_BUFFER_MAX) {
+    if ((count = atoi(argv[2])) < 0 || count > connection->txSize) {
         sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
         return;
     }
@@ -0,0 +1,167 @@
+/*
+    sscp-dns.c - Simple Serial Command Protocol host name cache
+
+	Copyright (c) 2019 Parallax Inc.
+    See the file LICENSE.txt for licensing information.
+*/
+
+#include "esp8266.h"
+#include "sscp.h"
+#include "config.h"
+
+/*
+    Host name cache
+
+    TCP and UDP CONNECT look host names up here before going to the resolver
+    so reconnecting to the same host doesn't wait for a DNS round trip.
+    Addresses are kept for dns-cache-ttl seconds and failed lookups for
+    SSCP_DNS_NEGATIVE_TTL seconds, so a misspelled name doesn't hit the
+    resolver on every retry either. lwIP doesn't hand the record TTL to
+    espconn, but a lookup that misses here is still answered from lwIP's own
+    table while the record is valid. The number of entries is the
+    dns-cache-size setting, zero for SSCP_DNS_DEFAULT_SIZE and -1 to turn
+    the cache off. When it is full the least recently used entry is
+    replaced.
+*/
+
+#define SSCP_DNS_NAME_MAX       64      // longer names are not cached
+#define SSCP_DNS_CACHE_MAX      16
+#define SSCP_DNS_DEFAULT_SIZE   4       // entries, used when dns-cache-size is zero
+#define SSCP_DNS_DEFAULT_TTL    300     // seconds, used when dns-cache-ttl is zero
+#define SSCP_DNS_NEGATIVE_TTL   10      // seconds
+#define SSCP_DNS_CLOCK_INTERVAL 60000   // ms, much less than the 71 minute wrap of system_get_time
+
+typedef struct {
+    char name[SSCP_DNS_NAME_MAX];
+    ip_addr_t addr;
+    int found;          // zero for a failed lookup
+    uint32 expires;     // seconds, see dns_now
+    uint32 used;
+} dns_entry;
+
+static dns_entry *cache = NULL;
+static int cacheSize = 0;
+static os_timer_t clockTimer;
+
+// seconds since boot, system_get_time wraps after 71 minutes
+static uint32 ICACHE_FLASH_ATTR dns_now(void)
+{
+    static uint32 lastTime = 0;
+    static uint32 wraps = 0;
+    uint32 now = system_get_time();
+    if (now < lastTime)
+        ++wraps;
+    lastTime = now;
+    return (uint32)((((uint64)wraps << 32) | now) / 1000000);
+}
+
+// a wrap is only seen if dns_now runs at least once in every period, so while
+// the cache holds entries it is also run from a timer
+static void ICACHE_FLASH_ATTR clock_timer_cb(void *data)
+{
+    dns_now();
+}
+
+// follow dns-cache-size, the cache starts out empty whenever it changes
+static int ICACHE_FLASH_ATTR dns_resize(void)
+{
+    int size = flashConfig.dns_cache_size;
+
+    if (size == 0)
+        size = SSCP_DNS_DEFAULT_SIZE;
+    else if (size < 0)
+        size = 0;
+    else if (size > SSCP_DNS_CACHE_MAX)
+        size = SSCP_DNS_CACHE_MAX;
+
+    if (size != cacheSize) {
+        if (cache)
+            os_free(cache);
+        cache = NULL;
+        cacheSize = 0;
+        os_timer_disarm(&clockTimer);
+        if (size > 0 && (cache = (dns_entry *)os_zalloc(size * sizeof(dns_entry))) != NULL) {
+            cacheSize = size;
+            dns_now();
+            os_timer_setfn(&clockTimer, clock_timer_cb, NULL);
+            os_timer_arm(&clockTimer, SSCP_DNS_CLOCK_INTERVAL, 1);
+        }
+    }
+
+    return cacheSize;
+}
+
+static dns_entry ICACHE_FLASH_ATTR *dns_find(const char *name, uint32 now)
+{
+    int i;
+    for (i = 0; i < cacheSize; ++i) {
+        dns_entry *entry = &cache[i];
+        if (entry->name[0] && (int32)(entry->expires - now) > 0 && os_strcmp(entry->name, name) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+void ICACHE_FLASH_ATTR sscp_dns_store(const char *name, ip_addr_t *ipaddr)
+{
+    dns_entry *entry;
+    uint32 now, ttl;
+    int i;
+
+    if (!name || os_strlen(name) >= SSCP_DNS_NAME_MAX || !dns_resize())
+        return;
+    now = dns_now();
+
+    // reuse the entry for this name, an empty or expired one, or the least recently used
+    if (!(entry = dns_find(name, now))) {
+        entry = &cache[0];
+        for (i = 0; i < cacheSize; ++i) {
+            if (!cache[i].name[0] || (int32)(cache[i].expires - now) <= 0) {
+                entry = &cache[i];
+                break;
+            }
+            if ((int32)(cache[i].used - entry->used) < 0)
+                entry = &cache[i];
+        }
+        os_strcpy(entry->name, name);
+    }
+
+    if (ipaddr) {
+        ttl = flashConfig.dns_cache_ttl > 0 ? flashConfig.dns_cache_ttl : SSCP_DNS_DEFAULT_TTL;
+        entry->addr = *ipaddr;
+        entry->found = 1;
+    }
+    else {
+        ttl = SSCP_DNS_NEGATIVE_TTL;
+        entry->addr.addr = 0;
+        entry->found = 0;
+    }
+    entry->expires = now + ttl;
+    entry->used = now;
+}
+
+// like espconn_gethostbyname but answers from the cache when it can
+// returns ESPCONN_ARG for a name that recently failed to resolve
+sint8 ICACHE_FLASH_ATTR sscp_gethostbyname(struct espconn *conn, const char *name, ip_addr_t *ipaddr, dns_found_callback cb)
+{
+    dns_entry *entry;
+    sint8 result;
+
+    if (dns_resize()) {
+        uint32 now = dns_now();
+        if ((entry = dns_find(name, now)) != NULL) {
+            entry->used = now;
+            if (!entry->found) {
+                sscp_log("DNS: '%s' failed recently", name);
+                return ESPCONN_ARG;
+            }
+            *ipaddr = entry->addr;
+            return ESPCONN_OK;
+        }
+    }
+
+    if ((result = espconn_gethostbyname(conn, name, ipaddr, cb)) == ESPCONN_OK)
+        sscp_dns_store(name, ipaddr);
+
+    return result;
+}
@@ -50,6 +50,7 @@ int ICACHE_FLASH_ATTR cgiSSCPHandleRequest(HttpdConnData *connData)
             if (connData->cgiReason == CGI_CB_DISCONNECT) {
 sscp_log("sscp: disconnecting %d", connection->hdr.handle);
                 connection->flags |= CONNECTION_TERM;
+                sscp_postEvent(connection->hdr.handle);
                 if (flashConfig.sscp_events)
                     send_disconnect_event(connection, '!');
             }
@@ -57,6 +58,7 @@ sscp_log("sscp: disconnecting %d", connection->hdr.handle);
 sscp_log("sscp: disconnecting after failure %d", connection->hdr.handle);
                 connection->flags |= CONNECTION_FAIL;
                 connection->error = connData->cgiValue;
+                sscp_postEvent(connection->hdr.handle);
                 if (flashConfig.sscp_events)
                     send_reconnect_event(connection, '!');
             }
@@ -78,6 +80,7 @@ sscp_log("REPLY complete");
             connection->flags |= CONNECTION_TXFREE; 
             ret = HTTPD_CGI_DONE;
         }
+        sscp_postEvent(connection->hdr.handle);
 
         if (flashConfig.sscp_events)
             send_txdone_event(connection, '!');
@@ -153,16 +156,13 @@ void ICACHE_FLASH_ATTR http_do_arg(int argc, char *argv[])
     sscp_sendResponse("N,0");
 }
 
-#define MAX_SENDBUFF_LEN 1024
-
 // this is called after all of the data for a REPLY has been received from the MCU
 static void ICACHE_FLASH_ATTR reply_cb(void *data, int count)
 {
     sscp_connection *connection = (sscp_connection *)data;
     HttpdConnData *connData = connection->d.http.conn;
     
-    char sendBuff[MAX_SENDBUFF_LEN];
-    httpdSetSendBuffer(connData, sendBuff, sizeof(sendBuff));
+    httpdSetConnSendBuffer(connData);
     
 sscp_log("REPLY payload callback: %d bytes of %d", count, connection->txCount);
     char buf[20];
@@ -172,7 +172,13 @@ sscp_log("REPLY payload callback: %d bytes of %d", count, connection->txCount);
     httpdHeader(connData, "Content-Length", buf);
     httpdEndHeaders(connData);
     httpdSend(connData, connection->txBuffer, count);
-    httpdFlushSendBuffer(connData);
+    
+    // the send backlog is full: nothing was queued, so the MCU can send the REPLY again later
+    if (!httpdFlushSendBuffer(connData)) {
+        connection->flags &= ~CONNECTION_TXFULL;
+        sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+        return;
+    }
     
     connection->flags &= ~CONNECTION_TXFULL;
     sscp_sendResponse("S,%d", connection->d.http.count);
@@ -217,7 +223,7 @@ sscp_log("REPLY: total %d, this %d", connection->txCount, count);
     if (connection->txCount < 0
     ||  count < 0
     ||  connection->txCount < count
-    ||  count > SSCP_TX_BUFFER_MAX) {
+    ||  count > connection->txSize) {
         sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
         return;
     }
@@ -273,7 +279,7 @@ static void ICACHE_FLASH_ATTR send_txdone_event(sscp_connection *connection, int
     connection->flags &= ~CONNECTION_TXDONE;
     sscp_send(prefix, "S,%d,0", connection->hdr.handle);
     if (connection->flags & CONNECTION_TXFREE)
-        connection->hdr.type = TYPE_UNUSED;
+        sscp_free_connection(connection);
 }
 
 static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
@@ -331,7 +337,12 @@ static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
     HttpdConnData *connData = connection->d.http.conn;
 sscp_log("  captured %d bytes", count);
     
-    httpdUnbufferedSend(connData, connection->txBuffer, count);
+    // the send backlog is full: nothing was queued, so the MCU can send this again later
+    if (!httpdUnbufferedSend(connData, connection->txBuffer, count)) {
+        connection->flags &= ~CONNECTION_TXFULL;
+        sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+        return;
+    }
     
     connection->flags &= ~CONNECTION_TXFULL;
     sscp_sendResponse("S,%d", connection->d.http.count);
@@ -222,14 +222,42 @@ static int setDbgStopBits(void *data, char *value)
     return 0;
 }
 
+// CTS and RTS are on GPIO13 and GPIO15
+static int isFlowControlPin(int pin)
+{
+    return pin == 13 || pin == 15;
+}
+
 static int setResetPin(void *data, char *value)
 {
+    if (flashConfig.uart_flow_control && isFlowControlPin(atoi(value)))
+        return -1;
     flashConfig.reset_pin = atoi(value);
     makeGpio(flashConfig.reset_pin);
     GPIO_OUTPUT_SET(flashConfig.reset_pin, 1);
     return 0;
 }
 
+static int setEventPin(void *data, char *value)
+{
+    if (flashConfig.uart_flow_control && isFlowControlPin(atoi(value)))
+        return -1;
+    flashConfig.sscp_event_pin = atoi(value);
+    sscp_initEventPin();
+    return 0;
+}
+
+static int setFlowControl(void *data, char *value)
+{
+    int enable = atoi(value) ? 1 : 0;
+    if (enable && (isFlowControlPin(flashConfig.reset_pin) || isFlowControlPin(flashConfig.sscp_event_pin)))
+        return -1;
+    flashConfig.uart_flow_control = enable;
+    uart_drain_tx_buffer(UART0);
+    uart0_flow_control(enable);
+    return 0;
+}
+
 static int enforceResetPin(void *data, char *value)
 {
     flashConfig.enforce_reset_pin = atoi(value);
@@ -376,6 +404,9 @@ static int getPinHandler(void *data, char *value)
 {
     int pin = (int)data;
     int ivalue = 0;
+    // makeGpio would take CTS or RTS away from the uart
+    if (flashConfig.uart_flow_control && isFlowControlPin(pin))
+        return -1;
     switch (pin) {
     case PIN_GPIO0:
     case PIN_GPIO1:
@@ -405,6 +436,8 @@ static int getPinHandler(void *data, char *value)
 static int setPinHandler(void *data, char *value)
 {
     int pin = (int)data;
+    if (flashConfig.uart_flow_control && isFlowControlPin(pin))
+        return -1;
     switch (pin) {
     case PIN_GPIO0:
     case PIN_GPIO1:
@@ -457,6 +490,25 @@ static int int8SetHandler(void *data, char *value)
     return 0;
 }
 
+static int getPoolFree(void *data, char *value)
+{
+    os_sprintf(value, "%d", sscp_pool_free());
+    return 0;
+}
+
+static int getFreeHeap(void *data, char *value)
+{
+    os_sprintf(value, "%d", (int)system_get_free_heap_size());
+    return 0;
+}
+
+static int uint32GetHandler(void *data, char *value)
+{
+    uint32_t *pValue = (uint32_t *)data;
+    os_sprintf(value, "%u", *pValue);
+    return 0;
+}
+
 static int uint8SetHandler(void *data, char *value)
 {
     uint8_t *pValue = (uint8_t *)data;
@@ -496,9 +548,32 @@ static cmd_def vars[] = {
 {   "cmd-loader",       int8GetHandler,     int8SetHandler,     &flashConfig.sscp_loader        },
 {   "cmd-p2-ddloader",  int8GetHandler,     int8SetHandler,     &flashConfig.p2_ddloader_enable },
 {   "cmd-cts-load",     int8GetHandler,     int8SetHandler,     &flashConfig.cts_load_enable    },
+{   "cmd-pipeline",     int8GetHandler,     int8SetHandler,     &flashConfig.sscp_pipeline      },
+{   "cmd-event-pin",    int8GetHandler,     setEventPin,        &flashConfig.sscp_event_pin     },
+{   "cmd-flow-control", int8GetHandler,     setFlowControl,     &flashConfig.uart_flow_control  },
 {   "loader-baud-rate", intGetHandler,      setLoaderBaudrate,  &flashConfig.loader_baud_rate   },
 {   "baud-rate",        intGetHandler,      setBaudrate,        &flashConfig.baud_rate          },
 {   "stop-bits",        int8GetHandler,     setStopBits,        &flashConfig.stop_bits          },
+{   "cmd-connections",  int8GetHandler,     int8SetHandler,     &flashConfig.sscp_connections   },
+{   "cmd-buffer-pool",  intGetHandler,      intSetHandler,      &flashConfig.sscp_buffer_pool   },
+{   "cmd-buffer-free",  getPoolFree,        NULL,               NULL                            },
+{   "tcp-buffer-size",  intGetHandler,      intSetHandler,      &flashConfig.tcp_buffer_size    },
+{   "udp-buffer-size",  intGetHandler,      intSetHandler,      &flashConfig.udp_buffer_size    },
+{   "http-buffer-size", intGetHandler,      intSetHandler,      &flashConfig.http_buffer_size   },
+{   "http-idle-timeout",intGetHandler,      intSetHandler,      &flashConfig.http_idle_timeout  },
+{   "ws-idle-timeout",  intGetHandler,      intSetHandler,      &flashConfig.ws_idle_timeout    },
+{   "tcp-idle-timeout", intGetHandler,      intSetHandler,      &flashConfig.tcp_idle_timeout   },
+{   "udp-idle-timeout", intGetHandler,      intSetHandler,      &flashConfig.udp_idle_timeout   },
+{   "cmd-reaped",       uint32GetHandler,   NULL,               &sscp_reaped_count              },
+{   "dns-cache-size",   int8GetHandler,     int8SetHandler,     &flashConfig.dns_cache_size     },
+{   "dns-cache-ttl",    intGetHandler,      intSetHandler,      &flashConfig.dns_cache_ttl      },
+{   "http-mallocs",     uint32GetHandler,   NULL,               &httpdStats.mallocs             },
+{   "http-malloc-fails",uint32GetHandler,   NULL,               &httpdStats.mallocFailures      },
+{   "heap-min-free",    uint32GetHandler,   NULL,               &httpdStats.minFreeHeap         },
+{   "heap-free",        getFreeHeap,        NULL,               NULL                            },
+{   "uart-rx-overflows",uint32GetHandler,   NULL,               &uart0_rxStats.fifoOverflows    },
+{   "uart-rx-dropped",  uint32GetHandler,   NULL,               &uart0_rxStats.ringOverflows    },
+{   "uart-frame-errors",uint32GetHandler,   NULL,               &uart0_rxStats.framingErrors    },
 {   "dbg-baud-rate",    intGetHandler,      setDbgBaudrate,     &flashConfig.dbg_baud_rate      },
 {   "dbg-stop-bits",    int8GetHandler,     setDbgStopBits,     &flashConfig.dbg_stop_bits      },
 {   "dbg-enable",       int8GetHandler,     int8SetHandler,     &flashConfig.dbg_enable         },
@@ -627,6 +702,10 @@ int ICACHE_FLASH_ATTR cgiPropSetting(HttpdConnData *connData)
             httpdSendResponse(connData, 400, "Missing value argument\r\n", -1);
             return HTTPD_CGI_DONE;
         }
+        if (!def->setHandler) {
+            httpdSendResponse(connData, 400, "Read-only setting\r\n", -1);
+            return HTTPD_CGI_DONE;
+        }
         os_printf("SET '%s' to '%s'", def->name, value);
         if ((*def->setHandler)(def->data, value) != 0) {
             os_printf(" --> ERROR\n");
@@ -9,20 +9,66 @@
 #include "sscp.h"
 #include "config.h"
 
+#define TCP_SERVER_TIMEOUT  7200    // seconds, the longest the SDK allows
+
 static void dns_cb(const char *name, ip_addr_t *ipaddr, void *arg);
 static void tcp_connect_cb(void *arg);
+static void tcp_accept_cb(void *arg);
 static void tcp_discon_cb(void *arg);
 static void tcp_recv_cb(void *arg, char *data, unsigned short len);
 static void tcp_sent_cb(void *arg);
+static void tcp_write_finish_cb(void *arg);
 static void tcp_recon_cb(void *arg, sint8 errType);
 
+/*
+    Receive queue
+
+    Data from the network goes into rxBuffer. Whatever doesn't fit is queued
+    on the heap in the order it arrived and moved into rxBuffer as RECV makes
+    room. Once more than a buffer full is waiting the connection is put on
+    hold so lwIP stops acknowledging data and the peer slows down to the rate
+    at which the MCU reads it. The hold is lifted when RECV has drained the
+    backlog to half a buffer.
+*/
+
+/*
+    Transmit queue
+
+    SEND payloads are queued on the heap and handed to espconn_send in order.
+    Connections use ESPCONN_COPY so espconn copies the data into its own write
+    buffer and several sends can be in flight, up to the TCP window. When
+    espconn has no room left the rest waits for tcp_sent_cb or the write
+    finish callback. SEND is answered as soon as its payload is queued and is
+    only refused with SSCP_ERROR_BUSY when the queue can't hold it. Each time
+    segments are acknowledged an 'S' event reports how much room there is.
+
+    TCPOPT can turn ESPCONN_COPY off to save the write buffer. espconn then
+    sends straight from the head of the queue, which has to stay put until
+    tcp_sent_cb, so only one payload is in flight at a time.
+*/
+
+#define TCP_RX_HIGH_WATER(c)    ((c)->rxSize)
+#define TCP_RX_LOW_WATER(c)     ((c)->rxSize / 2)
+#define TCP_TX_QUEUE_MAX(c)     (4 * (c)->txSize)
+
+struct sscp_chunk {
+    sscp_chunk *next;
+    int length;
+    int index;
+    char data[1];
+};
+
 static void send_connect_event(sscp_connection *connection, int prefix);
 static void send_disconnect_event(sscp_connection *connection, int prefix);
 static void send_data_event(sscp_connection *connection, int prefix);
+static void send_txspace_event(sscp_connection *connection, int prefix);
+static void send_fail_event(sscp_connection *connection, int prefix);
 static int checkForEvents_handler(sscp_hdr *hdr);
 static void send_handler(sscp_hdr *hdr, int size);
 static void recv_handler(sscp_hdr *hdr, int size);
 static void close_handler(sscp_hdr *hdr);
+static void listener_path_handler(sscp_hdr *hdr);
+static void listener_close_handler(sscp_hdr *hdr);
 
 static sscp_dispatch tcpDispatch = {
     .checkForEvents = checkForEvents_handler,
@@ -32,6 +78,14 @@ static sscp_dispatch tcpDispatch = {
     .close = close_handler
 };
 
+static sscp_dispatch tcpListenerDispatch = {
+    .checkForEvents = NULL,
+    .path = listener_path_handler,
+    .send = NULL,
+    .recv = NULL,
+    .close = listener_close_handler
+};
+
 void ICACHE_FLASH_ATTR tcp_do_connect(int argc, char *argv[])
 {
     sscp_connection *c;
@@ -51,6 +105,7 @@ void ICACHE_FLASH_ATTR tcp_do_connect(int argc, char *argv[])
     conn = &c->d.tcp.conn;
 
     os_memset(&c->d.tcp, 0, sizeof(c->d.tcp));
+    c->d.tcp.pConn = conn;
     conn->type = ESPCONN_TCP;
     conn->state = ESPCONN_NONE;
     conn->proto.tcp = &c->d.tcp.tcp;
@@ -63,7 +118,7 @@ void ICACHE_FLASH_ATTR tcp_do_connect(int argc, char *argv[])
     if (isdigit((int)*argv[1]))
         ipAddr.addr = ipaddr_addr(argv[1]);
     else {
-        switch (espconn_gethostbyname(conn, argv[1], &ipAddr, dns_cb)) {
+        switch (sscp_gethostbyname(conn, argv[1], &ipAddr, dns_cb)) {
         case ESPCONN_OK:
             // connect below
             break;
@@ -90,11 +145,180 @@ void ICACHE_FLASH_ATTR tcp_do_connect(int argc, char *argv[])
     c->d.tcp.state = TCP_STATE_CONNECTING;
 }
 
+// LISTEN,TCP,port
+void ICACHE_FLASH_ATTR tcp_do_listen(int argc, char *argv[])
+{
+    sscp_listener *listener;
+    struct espconn *conn;
+    char path[8];
+    int port;
+
+    if (argc != 3) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+        return;
+    }
+
+    port = atoi(argv[2]);
+    if (!isdigit((int)*argv[2]) || port <= 0 || port > 65535) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+        return;
+    }
+
+    // the path of a TCP listener is its port number
+    os_sprintf(path, "%d", port);
+    if (sscp_find_listener(path, TYPE_TCP_LISTENER)) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_STATE);
+        return;
+    }
+
+    if (!(listener = sscp_allocate_listener(TYPE_TCP_LISTENER, path, &tcpListenerDispatch))) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_NO_FREE_LISTENER);
+        return;
+    }
+    conn = &listener->tcp.conn;
+
+    os_memset(&listener->tcp, 0, sizeof(listener->tcp));
+    conn->type = ESPCONN_TCP;
+    conn->state = ESPCONN_NONE;
+    conn->proto.tcp = &listener->tcp.tcp;
+    conn->proto.tcp->local_port = port;
+    conn->reverse = (void *)listener;
+
+    espconn_regist_connectcb(conn, tcp_accept_cb);
+
+    if (espconn_accept(conn) != ESPCONN_OK) {
+        sscp_close_listener(listener);
+        sscp_sendResponse("E,%d", SSCP_ERROR_INTERNAL_ERROR);
+        return;
+    }
+    espconn_regist_time(conn, TCP_SERVER_TIMEOUT, 0);
+    espconn_tcp_set_max_con_allow(conn, sscp_connection_count);
+
+    sscp_log("TCP: listening on port %d with %d", port, listener->hdr.handle);
+    sscp_sendResponse("S,%d", listener->hdr.handle);
+}
+
+static void ICACHE_FLASH_ATTR tcp_accept_cb(void *arg)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    sscp_listener *listener;
+    sscp_connection *c;
+    char path[8];
+
+    os_sprintf(path, "%d", conn->proto.tcp->local_port);
+    if (!(listener = sscp_find_listener(path, TYPE_TCP_LISTENER))) {
+        espconn_disconnect(conn);
+        return;
+    }
+
+    if (!(c = sscp_allocate_connection(TYPE_TCP_CONNECTION, &tcpDispatch))) {
+        sscp_log("TCP: no free connection for port %s", path);
+        espconn_disconnect(conn);
+        return;
+    }
+    c->listenerHandle = listener->hdr.handle;
+    c->d.tcp.pConn = conn;
+    c->d.tcp.state = TCP_STATE_CONNECTED;
+    conn->reverse = (void *)c;
+
+    espconn_regist_disconcb(conn, tcp_discon_cb);
+    espconn_regist_recvcb(conn, tcp_recv_cb);
+    espconn_regist_sentcb(conn, tcp_sent_cb);
+    espconn_regist_reconcb(conn, tcp_recon_cb);
+    espconn_regist_write_finish(conn, tcp_write_finish_cb);
+    espconn_set_opt(conn, ESPCONN_COPY);
+
+    sscp_log("TCP: %d accepted on port %s", c->hdr.handle, path);
+    if (flashConfig.sscp_events)
+        send_connect_event(c, '!');
+}
+
+// TCPOPT,chan,NODELAY,on
+// TCPOPT,chan,KEEPALIVE,idle[,interval,count]
+// TCPOPT,chan,COPY,on
+void ICACHE_FLASH_ATTR tcp_do_opt(int argc, char *argv[])
+{
+    sscp_connection *c;
+    struct espconn *conn;
+    sint8 result;
+    char *option;
+
+    if (argc < 4) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+        return;
+    }
+
+    if (!(c = sscp_get_connection(atoi(argv[1]))) || c->hdr.type != TYPE_TCP_CONNECTION) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+        return;
+    }
+
+    if (c->d.tcp.state != TCP_STATE_CONNECTED) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_STATE);
+        return;
+    }
+    conn = c->d.tcp.pConn;
+    option = argv[2];
+
+    if (os_strcmp(option, "NODELAY") == 0 && argc == 4) {
+        if (atoi(argv[3]))
+            result = espconn_set_opt(conn, ESPCONN_NODELAY);
+        else
+            result = espconn_clear_opt(conn, ESPCONN_NODELAY);
+    }
+
+    // an idle time of zero turns keepalive off, interval and count keep the lwIP defaults when left out
+    else if (os_strcmp(option, "KEEPALIVE") == 0 && (argc == 4 || argc == 6)) {
+        uint32 idle = atoi(argv[3]);
+        if (idle == 0)
+            result = espconn_clear_opt(conn, ESPCONN_KEEPALIVE);
+        else if ((result = espconn_set_opt(conn, ESPCONN_KEEPALIVE)) == ESPCONN_OK) {
+            result = espconn_set_keepalive(conn, ESPCONN_KEEPIDLE, &idle);
+            if (result == ESPCONN_OK && argc == 6) {
+                uint32 interval = atoi(argv[4]);
+                uint32 count = atoi(argv[5]);
+                if ((result = espconn_set_keepalive(conn, ESPCONN_KEEPINTVL, &interval)) == ESPCONN_OK)
+                    result = espconn_set_keepalive(conn, ESPCONN_KEEPCNT, &count);
+            }
+        }
+    }
+
+    else if (os_strcmp(option, "COPY") == 0 && argc == 4) {
+        if (atoi(argv[3])) {
+            if ((result = espconn_set_opt(conn, ESPCONN_COPY)) == ESPCONN_OK)
+                c->d.tcp.txReuse = 0;
+        }
+        else {
+            if ((result = espconn_clear_opt(conn, ESPCONN_COPY)) == ESPCONN_OK)
+                c->d.tcp.txReuse = 1;
+        }
+    }
+
+    else {
+        sscp_sendResponse("E,%d", argc == 4 ? SSCP_ERROR_INVALID_ARGUMENT : SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+        return;
+    }
+
+    if (result != ESPCONN_OK) {
+        sscp_log("TCP: %d option %s failed %d", c->hdr.handle, option, result);
+        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+        return;
+    }
+
+    sscp_sendResponse("S,0");
+}
+
 static void ICACHE_FLASH_ATTR dns_cb(const char *name, ip_addr_t *ipaddr, void *arg)
 {
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
 
+    sscp_dns_store(name, ipaddr);
+
+    // closed while the lookup was in progress
+    if (!c)
+        return;
+
     if (!ipaddr) {
         sscp_log("TCP: no IP address found for '%s'", name);
         sscp_close_connection(c);
@@ -125,79 +349,258 @@ static void ICACHE_FLASH_ATTR tcp_connect_cb(void *arg)
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
 
+    // closed while the connection was being made
+    if (!c) {
+        espconn_disconnect(conn);
+        return;
+    }
+
     espconn_regist_disconcb(conn, tcp_discon_cb);
     espconn_regist_recvcb(conn, tcp_recv_cb);
     espconn_regist_sentcb(conn, tcp_sent_cb);
+    espconn_regist_write_finish(conn, tcp_write_finish_cb);
+    espconn_set_opt(conn, ESPCONN_COPY);
 
     c->d.tcp.state = TCP_STATE_CONNECTED;
     sscp_sendResponse("S,%d", c->hdr.handle);
 }
 
+// the SDK frees the espconn of an accepted socket once its disconnect or reconnect callback returns
+static void ICACHE_FLASH_ATTR release_espconn(sscp_connection *c)
+{
+    if (c->d.tcp.pConn != &c->d.tcp.conn) {
+        c->d.tcp.pConn = NULL;
+        c->d.tcp.rxHeld = 0;
+    }
+}
+
 static void ICACHE_FLASH_ATTR tcp_discon_cb(void *arg)
 {
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
+    if (!c)
+        return;
     c->flags |= CONNECTION_TERM;
+    sscp_postEvent(c->hdr.handle);
     sscp_log("TCP: %d disconnected", c->hdr.handle);
     c->d.tcp.state = TCP_STATE_IDLE;
+    release_espconn(c);
 }
 
-static void ICACHE_FLASH_ATTR tcp_recv_cb(void *arg, char *data, unsigned short len)
+static int ICACHE_FLASH_ATTR rx_pending(sscp_connection *c)
+{
+    return c->rxCount - c->rxIndex + c->d.tcp.rxQueued;
+}
+
+// add a copy of data to the end of a queue
+static int ICACHE_FLASH_ATTR chunk_append(sscp_chunk **pQueue, char *data, int len)
+{
+    sscp_chunk *chunk;
+
+    if (!(chunk = (sscp_chunk *)os_malloc(sizeof(sscp_chunk) + len)))
+        return -1;
+    chunk->next = NULL;
+    chunk->length = len;
+    chunk->index = 0;
+    os_memcpy(chunk->data, data, len);
+
+    while (*pQueue != NULL)
+        pQueue = &(*pQueue)->next;
+    *pQueue = chunk;
+
+    return 0;
+}
+
+static void ICACHE_FLASH_ATTR chunk_free_all(sscp_chunk **pQueue)
+{
+    sscp_chunk *chunk;
+    while ((chunk = *pQueue) != NULL) {
+        *pQueue = chunk->next;
+        os_free(chunk);
+    }
+}
+
+// compact rxBuffer and top it up from the receive queue
+static void ICACHE_FLASH_ATTR rx_refill(sscp_connection *c)
 {
-    int i;
+    sscp_chunk *chunk;
 
+    if (c->rxIndex > 0) {
+        c->rxCount -= c->rxIndex;
+        os_memmove(c->rxBuffer, c->rxBuffer + c->rxIndex, c->rxCount);
+        c->rxIndex = 0;
+    }
+
+    while ((chunk = c->d.tcp.rxQueue) != NULL && c->rxCount < c->rxSize) {
+        int cnt = chunk->length - chunk->index;
+        if (cnt > c->rxSize - c->rxCount)
+            cnt = c->rxSize - c->rxCount;
+        os_memcpy(c->rxBuffer + c->rxCount, chunk->data + chunk->index, cnt);
+        c->rxCount += cnt;
+        c->d.tcp.rxQueued -= cnt;
+        if ((chunk->index += cnt) >= chunk->length) {
+            c->d.tcp.rxQueue = chunk->next;
+            os_free(chunk);
+        }
+    }
+}
+
+// hand queued SEND payloads to espconn until it won't take any more
+static void ICACHE_FLASH_ATTR tx_pump(sscp_connection *c)
+{
+    sscp_chunk *chunk;
+    sint8 result;
+
+    while ((chunk = c->d.tcp.txQueue) != NULL && c->d.tcp.state == TCP_STATE_CONNECTED) {
+        if (c->d.tcp.txInFlight)
+            break;
+        result = espconn_send(c->d.tcp.pConn, (uint8 *)chunk->data, chunk->length);
+        if (result == ESPCONN_MAXNUM || result == ESPCONN_INPROGRESS || result == ESPCONN_MEM)
+            break;
+        else if (result != ESPCONN_OK) {
+            sscp_log("TCP: %d send failed %d", c->hdr.handle, result);
+            chunk_free_all(&c->d.tcp.txQueue);
+            c->d.tcp.txQueued = 0;
+            c->error = result;
+            c->flags |= CONNECTION_FAIL;
+            sscp_postEvent(c->hdr.handle);
+            return;
+        }
+        if (c->d.tcp.txReuse) {
+            c->d.tcp.txInFlight = 1;
+            break;
+        }
+        c->d.tcp.txQueue = chunk->next;
+        c->d.tcp.txQueued -= chunk->length;
+        os_free(chunk);
+    }
+}
+
+static void ICACHE_FLASH_ATTR tcp_recv_cb(void *arg, char *data, unsigned short len)
+{
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
+    int cnt;
+
+    // the MCU has already closed the connection
+    if (!c || c->hdr.type != TYPE_TCP_CONNECTION)
+        return;
+
     sscp_log("TCP: %d received %d bytes", c->hdr.handle, len);
-    i = c->rxCount;
-    if ((len + i)> SSCP_RX_BUFFER_MAX)
-         len = SSCP_RX_BUFFER_MAX - i;
+
+    if (c->rxCount + len > c->rxSize)
+        rx_refill(c);
+
+    // only use rxBuffer if nothing is queued ahead of this data
+    if (!c->d.tcp.rxQueue) {
+        cnt = c->rxSize - c->rxCount;
+        if (cnt > len)
+            cnt = len;
+        os_memcpy(c->rxBuffer + c->rxCount, data, cnt);
+        c->rxCount += cnt;
+        data += cnt;
+        len -= cnt;
+        sscp_log("TCP: added %d bytes to buffer", cnt);
+    }
+
     if (len > 0) {
-        os_memcpy(c->rxBuffer + i, data, len);
-        c->rxCount = i + len;
-        c->rxIndex = 0;
-        if (c->rxCount >= SSCP_RX_BUFFER_MAX)
-            c->flags |= CONNECTION_RXFULL;
-        sscp_log("TCP: added %d bytes to buffer", len);
-        if (flashConfig.sscp_events && !(c->flags & CONNECTION_RXFULL))
-            send_data_event(c, '!');
+        if (chunk_append(&c->d.tcp.rxQueue, data, len) != 0)
+            sscp_log("TCP: %d out of memory, dropped %d bytes", c->hdr.handle, len);
+        else {
+            c->d.tcp.rxQueued += len;
+            sscp_log("TCP: queued %d bytes", len);
+        }
+    }
+
+    if (!c->d.tcp.rxHeld && rx_pending(c) >= TCP_RX_HIGH_WATER(c)) {
+        sscp_log("TCP: %d holding with %d bytes pending", c->hdr.handle, rx_pending(c));
+        espconn_recv_hold(conn);
+        c->d.tcp.rxHeld = 1;
     }
+
+    if (flashConfig.sscp_events && !(c->flags & CONNECTION_RXFULL))
+        send_data_event(c, '!');
     c->flags |= CONNECTION_RXFULL;
+    sscp_postEvent(c->hdr.handle);
 }
 
 static void ICACHE_FLASH_ATTR tcp_recon_cb(void *arg, sint8 errType)
 {
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
+    if (!c)
+        return;
 
+    // a failed CONNECT is still waiting for its response, otherwise this is a reset
+    if (c->d.tcp.state == TCP_STATE_CONNECTING)
+        sscp_sendResponse("E,%d", SSCP_ERROR_DISCONNECTED);
+    else {
+        c->flags |= CONNECTION_TERM;
+        sscp_postEvent(c->hdr.handle);
+    }
     c->d.tcp.state = TCP_STATE_IDLE;
-    sscp_sendResponse("E,%d", SSCP_ERROR_DISCONNECTED);
+    release_espconn(c);
 }
 
 static void ICACHE_FLASH_ATTR tcp_sent_cb(void *arg)
 {
     struct espconn *conn = (struct espconn *)arg;
     sscp_connection *c = (sscp_connection *)conn->reverse;
-    c->flags &= ~CONNECTION_TXFULL;
-    c->flags |= CONNECTION_TXDONE;
-    sscp_sendResponse("S,0");
+    if (!c || c->hdr.type != TYPE_TCP_CONNECTION)
+        return;
+    if (c->d.tcp.txInFlight) {
+        sscp_chunk *chunk = c->d.tcp.txQueue;
+        c->d.tcp.txQueue = chunk->next;
+        c->d.tcp.txQueued -= chunk->length;
+        c->d.tcp.txInFlight = 0;
+        os_free(chunk);
+    }
+    tx_pump(c);
+    if (!(c->flags & CONNECTION_TXDONE)) {
+        c->flags |= CONNECTION_TXDONE;
+        sscp_postEvent(c->hdr.handle);
+        if (flashConfig.sscp_events)
+            send_txspace_event(c, '!');
+    }
+}
+
+// espconn has room in its write buffer again
+static void ICACHE_FLASH_ATTR tcp_write_finish_cb(void *arg)
+{
+    struct espconn *conn = (struct espconn *)arg;
+    sscp_connection *c = (sscp_connection *)conn->reverse;
+    if (!c || c->hdr.type != TYPE_TCP_CONNECTION)
+        return;
+    tx_pump(c);
 }
 
 static void ICACHE_FLASH_ATTR send_connect_event(sscp_connection *connection, int prefix)
 {
     connection->flags &= ~CONNECTION_INIT;
-    sscp_sendResponse("T,%d,%d", connection->hdr.handle, connection->listenerHandle);
+    sscp_send(prefix, "T,%d,%d", connection->hdr.handle, connection->listenerHandle);
 }
 
 static void ICACHE_FLASH_ATTR send_disconnect_event(sscp_connection *connection, int prefix)
 {
     connection->flags &= ~CONNECTION_TERM;
-    sscp_sendResponse("X,%d,0", connection->hdr.handle);
+    sscp_send(prefix, "X,%d,0", connection->hdr.handle);
 }
 
 static void ICACHE_FLASH_ATTR send_data_event(sscp_connection *connection, int prefix)
 {
-    sscp_sendResponse("D,%d,%d", connection->hdr.handle, connection->rxCount);
+    sscp_send(prefix, "D,%d,%d", connection->hdr.handle, rx_pending(connection));
+}
+
+static void ICACHE_FLASH_ATTR send_txspace_event(sscp_connection *connection, int prefix)
+{
+    connection->flags &= ~CONNECTION_TXDONE;
+    sscp_send(prefix, "S,%d,%d", connection->hdr.handle, TCP_TX_QUEUE_MAX(connection) - connection->d.tcp.txQueued);
+}
+
+static void ICACHE_FLASH_ATTR send_fail_event(sscp_connection *connection, int prefix)
+{
+    connection->flags &= ~CONNECTION_FAIL;
+    sscp_send(prefix, "E,%d,%d", connection->hdr.handle, connection->error);
 }
 
 static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
@@ -214,11 +617,21 @@ static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
         return 1;
     }
     
+    else if (connection->flags & CONNECTION_FAIL) {
+        send_fail_event(connection, '=');
+        return 1;
+    }
+    
     else if (connection->flags & CONNECTION_RXFULL) {
         send_data_event(connection, '=');
         return 1;
     }
     
+    else if (connection->flags & CONNECTION_TXDONE) {
+        send_txspace_event(connection, '=');
+        return 1;
+    }
+    
     return 0;
 }
 
@@ -226,11 +639,13 @@ static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
 static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
 {
     sscp_connection *c = (sscp_connection *)data;
-    struct espconn *conn = &c->d.tcp.conn;
-    if (espconn_send(conn, (uint8 *)c->txBuffer, count) != ESPCONN_OK) {
-        c->flags &= ~CONNECTION_TXFULL;
+    if (chunk_append(&c->d.tcp.txQueue, c->txBuffer, count) != 0) {
         sscp_sendResponse("E,%d", SSCP_ERROR_SEND_FAILED);
+        return;
     }
+    c->d.tcp.txQueued += count;
+    tx_pump(c);
+    sscp_sendResponse("S,0");
 }
 
 static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
@@ -242,41 +657,81 @@ static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
         return;
     }
     
+    if (c->d.tcp.txQueued + size > TCP_TX_QUEUE_MAX(c)) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+        return;
+    }
+
     if (size == 0)
         sscp_sendResponse("S,0");
     else {
-        // response is sent by tcp_sent_cb
+        // response is sent by send_cb once the payload is queued
         sscp_capturePayload(c->txBuffer, size, send_cb, c);
-        c->flags |= CONNECTION_TXFULL;
     }
 }
 
 static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
 {
     sscp_connection *connection = (sscp_connection *)hdr;
+    int pending = rx_pending(connection);
+    int remaining;
     
-    if (connection->rxCount == 0) {
+    if (pending == 0) {
         sscp_sendResponse("S,0");
         return;
     }
 
-    if (connection->rxIndex + size > connection->rxCount)
-        size = connection->rxCount - connection->rxIndex;
+    if (size > pending)
+        size = pending;
 
     sscp_sendResponse("S,%d", size);
-    if (size > 0) {
-        sscp_sendPayload(connection->rxBuffer + connection->rxIndex, size);
-        connection->rxIndex += size;
+    for (remaining = size; remaining > 0; ) {
+        int cnt;
+        if (connection->rxIndex >= connection->rxCount)
+            rx_refill(connection);
+        cnt = connection->rxCount - connection->rxIndex;
+        if (cnt > remaining)
+            cnt = remaining;
+        sscp_sendPayload(connection->rxBuffer + connection->rxIndex, cnt);
+        connection->rxIndex += cnt;
+        remaining -= cnt;
     }
     
     if (connection->rxIndex >= connection->rxCount)
+        rx_refill(connection);
+
+    if (connection->d.tcp.rxHeld && connection->d.tcp.pConn && rx_pending(connection) <= TCP_RX_LOW_WATER(connection)) {
+        sscp_log("TCP: %d resuming with %d bytes pending", connection->hdr.handle, rx_pending(connection));
+        espconn_recv_unhold(connection->d.tcp.pConn);
+        connection->d.tcp.rxHeld = 0;
+    }
+
+    if (rx_pending(connection) == 0)
         connection->flags &= ~CONNECTION_RXFULL;
 }
 
 static void ICACHE_FLASH_ATTR close_handler(sscp_hdr *hdr)
 {
     sscp_connection *connection = (sscp_connection *)hdr;
-    struct espconn *conn = &connection->d.tcp.conn;
-    if (conn)
-        espconn_disconnect(conn);
+    struct espconn *conn = connection->d.tcp.pConn;
+    chunk_free_all(&connection->d.tcp.rxQueue);
+    chunk_free_all(&connection->d.tcp.txQueue);
+    if (conn) {
+        // callbacks that are still on their way must not find this slot once it is reused
+        conn->reverse = NULL;
+        if (connection->d.tcp.state != TCP_STATE_IDLE)
+            espconn_disconnect(conn);
+    }
+}
+
+static void ICACHE_FLASH_ATTR listener_path_handler(sscp_hdr *hdr)
+{
+    sscp_listener *listener = (sscp_listener *)hdr;
+    sscp_sendResponse("S,%s", listener->path);
+}
+
+static void ICACHE_FLASH_ATTR listener_close_handler(sscp_hdr *hdr)
+{
+    sscp_listener *listener = (sscp_listener *)hdr;
+    espconn_delete(&listener->tcp.conn);
 }
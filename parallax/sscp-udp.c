@@ -10,6 +10,32 @@
 #include "sscp.h"
 #include "config.h"
 
+/*
+    Receive queue
+
+    A datagram goes into rxBuffer, along with the address it came from, when
+    rxBuffer is empty. Datagrams that arrive while the MCU is still reading
+    the previous one are queued on the heap, up to UDP_RX_QUEUE_MAX, and moved
+    into rxBuffer one at a time as RECV finishes each one. RECV never returns
+    data from two datagrams and reports the sender of the one it reads from.
+    RECVFROM does the same but discards whatever is left of the datagram.
+
+    A connection made by LISTEN,UDP is bound to a local port and has no
+    remote end. It receives from anyone and SENDTO addresses each datagram.
+    SENDTO works on connected handles too, SEND always goes to the host
+    given to CONNECT.
+*/
+
+#define UDP_RX_QUEUE_MAX    8
+
+struct sscp_datagram {
+	sscp_datagram *next;
+	uint8 remoteIp[4];
+	int remotePort;
+	int length;
+	char data[1];
+};
+
 static void dns_cb(const char *name, ip_addr_t *ipaddr, void *arg);
 static void udp_recv_cb(void *arg, char *data, unsigned short len);
 static void udp_sent_cb(void *arg);
@@ -28,13 +54,14 @@ static sscp_dispatch udpDispatch = {
     .close = close_handler
 };
 
+// UDP,host,port[,localport]
 void ICACHE_FLASH_ATTR udp_do_connect(int argc, char *argv[])
 {
 	sscp_connection *c;
 	struct espconn *conn;
 	ip_addr_t ipAddr;
 
-	if (argc != 3) {
+	if (argc != 3 && argc != 4) {
 		sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
 		return;
 	}
@@ -51,9 +78,12 @@ void ICACHE_FLASH_ATTR udp_do_connect(int argc, char *argv[])
 	conn->state = ESPCONN_NONE;
 	conn->proto.udp = &c->d.udp.udp;
 	conn->proto.udp->remote_port = atoi(argv[2]);
-	if (conn->proto.udp->remote_port > 1023) {
+	if (argc == 4)
+		conn->proto.udp->local_port = atoi(argv[3]);
+	else if (conn->proto.udp->remote_port > 1023) {
 		conn->proto.udp->local_port = conn->proto.udp->remote_port;
 	}
+	c->d.udp.remotePort = conn->proto.udp->remote_port;
 	conn->reverse = (void *)c;
 
 	espconn_regist_recvcb(conn, udp_recv_cb);
@@ -63,7 +93,7 @@ void ICACHE_FLASH_ATTR udp_do_connect(int argc, char *argv[])
             ipAddr.addr = ipaddr_addr(argv[1]);
 	}
 	else {
-		switch (espconn_gethostbyname(conn, argv[1], &ipAddr, dns_cb)) {
+		switch (sscp_gethostbyname(conn, argv[1], &ipAddr, dns_cb)) {
 		case ESPCONN_OK:
 			// connect below
 			break;
@@ -79,6 +109,7 @@ void ICACHE_FLASH_ATTR udp_do_connect(int argc, char *argv[])
 	}
 
 	memcpy(conn->proto.udp->remote_ip, &ipAddr.addr, 4);
+	os_memcpy(c->d.udp.remoteIp, &ipAddr.addr, 4);
 
 	// response is sent by udp_connect_cb or udp_recon_cb
 	c->d.udp.state = TCP_STATE_CONNECTING;
@@ -94,11 +125,63 @@ void ICACHE_FLASH_ATTR udp_do_connect(int argc, char *argv[])
 	sscp_sendResponse("S,%d", c->hdr.handle);
 }
 
+// LISTEN,UDP,port
+void ICACHE_FLASH_ATTR udp_do_listen(int argc, char *argv[])
+{
+	sscp_connection *c;
+	struct espconn *conn;
+	int port;
+
+	if (argc != 3) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+		return;
+	}
+
+	port = atoi(argv[2]);
+	if (!isdigit((int)*argv[2]) || port <= 0 || port > 65535) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return;
+	}
+
+	if (!(c = sscp_allocate_connection(TYPE_UDP_CONNECTION, &udpDispatch))) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_NO_FREE_CONNECTION);
+		return;
+	}
+
+	conn = &c->d.udp.conn;
+	os_memset(&c->d.udp, 0, sizeof(c->d.udp));
+	conn->type = ESPCONN_UDP;
+	conn->state = ESPCONN_NONE;
+	conn->proto.udp = &c->d.udp.udp;
+	conn->proto.udp->local_port = port;
+	conn->reverse = (void *)c;
+	c->d.udp.unconnected = 1;
+
+	espconn_regist_recvcb(conn, udp_recv_cb);
+	espconn_regist_sentcb(conn, udp_sent_cb);
+
+	if (espconn_create(conn) != 0) {
+		sscp_close_connection(c);
+		sscp_sendResponse("E,%d", SSCP_ERROR_CONNECT_FAILED);
+		return;
+	}
+
+	sscp_log("UDP Handle: %d bound to port %d", c->hdr.handle, port);
+	c->d.udp.state = TCP_STATE_CONNECTED;
+	sscp_sendResponse("S,%d", c->hdr.handle);
+}
+
 static void ICACHE_FLASH_ATTR dns_cb(const char *name, ip_addr_t *ipaddr, void *arg)
 {
 	struct espconn *conn = (struct espconn *)arg;
 	sscp_connection *c = (sscp_connection *)conn->reverse;
 
+	sscp_dns_store(name, ipaddr);
+
+	// closed while the lookup was in progress
+	if (!c)
+		return;
+
 	if (!ipaddr) {
 		sscp_log("UDP: no IP address found for '%s'", name);
 		sscp_close_connection(c);
@@ -114,6 +197,7 @@ static void ICACHE_FLASH_ATTR dns_cb(const char *name, ip_addr_t *ipaddr, void *
 		name);
 
 	os_memcpy(conn->proto.udp->remote_ip, &ipaddr->addr, 4);
+	os_memcpy(c->d.udp.remoteIp, &ipaddr->addr, 4);
 
 	if (espconn_create(conn) != 0) {
 		sscp_close_connection(c);
@@ -125,27 +209,96 @@ static void ICACHE_FLASH_ATTR dns_cb(const char *name, ip_addr_t *ipaddr, void *
 	sscp_sendResponse("S,%d", c->hdr.handle);
 }
 
+// move the oldest queued datagram into rxBuffer
+static int ICACHE_FLASH_ATTR rx_next(sscp_connection *c)
+{
+	sscp_datagram *datagram;
+
+	if (!(datagram = c->d.udp.rxQueue))
+		return 0;
+	c->d.udp.rxQueue = datagram->next;
+	--c->d.udp.rxQueued;
+
+	os_memcpy(c->rxBuffer, datagram->data, datagram->length);
+	c->rxCount = datagram->length;
+	c->rxIndex = 0;
+	os_memcpy(c->d.udp.rxRemoteIp, datagram->remoteIp, 4);
+	c->d.udp.rxRemotePort = datagram->remotePort;
+	os_free(datagram);
+
+	return 1;
+}
+
+static void ICACHE_FLASH_ATTR rx_free_all(sscp_connection *c)
+{
+	sscp_datagram *datagram;
+	while ((datagram = c->d.udp.rxQueue) != NULL) {
+		c->d.udp.rxQueue = datagram->next;
+		os_free(datagram);
+	}
+	c->d.udp.rxQueued = 0;
+}
+
 static void ICACHE_FLASH_ATTR udp_recv_cb(void *arg, char *data, unsigned short len)
 {
 	struct espconn *conn = (struct espconn *)arg;
 	sscp_connection *c = (sscp_connection *)conn->reverse;
+	sscp_datagram *datagram, **pNext;
+	remot_info *remote = NULL;
+
+	if (!c)
+		return;
+
 	sscp_log("UDP Handle: %d received %d bytes", c->hdr.handle, len);
+	if (len > c->rxSize)
+		len = c->rxSize;
+
 	if (!(c->flags & CONNECTION_RXFULL)) {
-		if (len > SSCP_RX_BUFFER_MAX)
-                   len = SSCP_RX_BUFFER_MAX;
 		os_memcpy(c->rxBuffer, data, len);
 		c->rxCount = len;
 		c->rxIndex = 0;
+		if (espconn_get_connection_info(conn, &remote, 0) == ESPCONN_OK && remote) {
+			os_memcpy(c->d.udp.rxRemoteIp, remote->remote_ip, 4);
+			c->d.udp.rxRemotePort = remote->remote_port;
+		}
 		c->flags |= CONNECTION_RXFULL;
+		sscp_postEvent(c->hdr.handle);
 		if (flashConfig.sscp_events)
 			send_data_event(c, '!');
+		return;
 	}
+
+	if (c->d.udp.rxQueued >= UDP_RX_QUEUE_MAX
+	||  !(datagram = (sscp_datagram *)os_malloc(sizeof(sscp_datagram) + len))) {
+		++c->d.udp.rxDropped;
+		sscp_log("UDP Handle: %d dropped %d bytes, %d queued", c->hdr.handle, len, c->d.udp.rxQueued);
+		return;
+	}
+
+	datagram->next = NULL;
+	datagram->length = len;
+	os_memcpy(datagram->data, data, len);
+	if (espconn_get_connection_info(conn, &remote, 0) == ESPCONN_OK && remote) {
+		os_memcpy(datagram->remoteIp, remote->remote_ip, 4);
+		datagram->remotePort = remote->remote_port;
+	}
+	else {
+		os_memset(datagram->remoteIp, 0, 4);
+		datagram->remotePort = 0;
+	}
+
+	for (pNext = &c->d.udp.rxQueue; *pNext != NULL; pNext = &(*pNext)->next)
+		;
+	*pNext = datagram;
+	++c->d.udp.rxQueued;
 }
 
 static void ICACHE_FLASH_ATTR udp_sent_cb(void *arg)
 {
 	struct espconn *conn = (struct espconn *)arg;
 	sscp_connection *c = (sscp_connection *)conn->reverse;
+	if (!c)
+		return;
 	c->flags &= ~CONNECTION_TXFULL;
 	c->flags |= CONNECTION_TXDONE;
 	sscp_log("UDP Handle: %d sent %d bytes", c->hdr.handle, c->rxCount);
@@ -157,20 +310,16 @@ static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
 	sscp_connection *c = (sscp_connection *)data;
 	struct espconn *conn = &c->d.udp.conn;
 	conn->state = ESPCONN_NONE;
+	os_memcpy(conn->proto.udp->remote_ip, c->d.udp.txRemoteIp, 4);
+	conn->proto.udp->remote_port = c->d.udp.txRemotePort;
 	if (espconn_sendto(conn, (uint8 *)c->txBuffer, count) != ESPCONN_OK) {
 		c->flags &= ~CONNECTION_TXFULL;
 		sscp_sendResponse("E,%d", SSCP_ERROR_SEND_FAILED);
 	}
 }
 
-static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
+static void ICACHE_FLASH_ATTR send_datagram(sscp_connection *c, int size)
 {
-	sscp_connection *c = (sscp_connection *)hdr;
-	if (c->d.udp.state != TCP_STATE_CONNECTED) {
-		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_STATE);
-		return;
-	}
-
 	if (size == 0)
 		sscp_sendResponse("S,0");
 	else {
@@ -180,9 +329,69 @@ static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
 	}
 }
 
-static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
+static void ICACHE_FLASH_ATTR send_handler(sscp_hdr *hdr, int size)
 {
-	sscp_connection *connection = (sscp_connection *)hdr;
+	sscp_connection *c = (sscp_connection *)hdr;
+
+	// a bound handle has nowhere to send to without SENDTO
+	if (c->d.udp.state != TCP_STATE_CONNECTED || c->d.udp.unconnected) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_STATE);
+		return;
+	}
+
+	os_memcpy(c->d.udp.txRemoteIp, c->d.udp.remoteIp, 4);
+	c->d.udp.txRemotePort = c->d.udp.remotePort;
+	send_datagram(c, size);
+}
+
+// SENDTO,chan,ip,port,count
+void ICACHE_FLASH_ATTR udp_do_sendto(int argc, char *argv[])
+{
+	sscp_connection *c;
+	uint32 addr;
+	int port, count;
+
+	if (argc != 5) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+		return;
+	}
+
+	if (!(c = sscp_get_connection(atoi(argv[1]))) || c->hdr.type != TYPE_UDP_CONNECTION) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return;
+	}
+
+	// datagrams are addressed by IP so a send never waits on DNS
+	port = atoi(argv[3]);
+	if (!isdigit((int)*argv[2]) || (addr = ipaddr_addr(argv[2])) == IPADDR_NONE || port <= 0 || port > 65535) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return;
+	}
+
+	if (c->flags & CONNECTION_TXFULL) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+		return;
+	}
+
+	if ((count = atoi(argv[4])) < 0 || count > c->txSize) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_SIZE);
+		return;
+	}
+
+	if (c->d.udp.state != TCP_STATE_CONNECTED) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_STATE);
+		return;
+	}
+
+	os_memcpy(c->d.udp.txRemoteIp, &addr, 4);
+	c->d.udp.txRemotePort = port;
+	send_datagram(c, count);
+}
+
+static void ICACHE_FLASH_ATTR recv_datagram(sscp_connection *connection, int size, int discard)
+{
+	uint8 *ip = connection->d.udp.rxRemoteIp;
+	char addr[16];
 
 	if (!(connection->flags & CONNECTION_RXFULL)) {
 		sscp_sendResponse("S,0");
@@ -192,20 +401,59 @@ static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
 	if (connection->rxIndex + size > connection->rxCount)
 		size = connection->rxCount - connection->rxIndex;
 
-	sscp_sendResponse("S,%d", size);
+	// the sender follows the size so that a reply can be addressed to it
+	// (the address is one field so that it is sent as a single string in a frame)
+	os_sprintf(addr, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+	sscp_sendResponse("S,%d,%s,%d", size, addr, connection->d.udp.rxRemotePort);
 
 	if (size > 0) {
 		sscp_sendPayload(connection->rxBuffer + connection->rxIndex, size);
 		connection->rxIndex += size;
 	}
 
-	if (connection->rxIndex >= connection->rxCount)
-		connection->flags &= ~CONNECTION_RXFULL;
+	if (discard || connection->rxIndex >= connection->rxCount) {
+		if (rx_next(connection)) {
+			sscp_postEvent(connection->hdr.handle);
+			if (flashConfig.sscp_events)
+				send_data_event(connection, '!');
+		}
+		else
+			connection->flags &= ~CONNECTION_RXFULL;
+	}
+}
+
+static void ICACHE_FLASH_ATTR recv_handler(sscp_hdr *hdr, int size)
+{
+	recv_datagram((sscp_connection *)hdr, size, 0);
+}
+
+// RECVFROM,chan,count
+void ICACHE_FLASH_ATTR udp_do_recvfrom(int argc, char *argv[])
+{
+	sscp_connection *c;
+	int count;
+
+	if (argc != 3) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_WRONG_ARGUMENT_COUNT);
+		return;
+	}
+
+	if (!(c = sscp_get_connection(atoi(argv[1]))) || c->hdr.type != TYPE_UDP_CONNECTION) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return;
+	}
+
+	if ((count = atoi(argv[2])) < 0) {
+		sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_ARGUMENT);
+		return;
+	}
+
+	recv_datagram(c, count, 1);
 }
 
 static void ICACHE_FLASH_ATTR send_data_event(sscp_connection *connection, int prefix)
 {
-	sscp_sendResponse("D,%d,%d", connection->hdr.handle, connection->rxCount);
+	sscp_send(prefix, "D,%d,%d", connection->hdr.handle, connection->rxCount);
 }
 
 static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
@@ -224,6 +472,9 @@ static void ICACHE_FLASH_ATTR close_handler(sscp_hdr *hdr)
 {
 	sscp_connection *connection = (sscp_connection *)hdr;
 	struct espconn *conn = &connection->d.udp.conn;
-	if (conn)
+	rx_free_all(connection);
+	if (conn) {
+		conn->reverse = NULL;
 		espconn_delete(conn);
+	}
 }
\ No newline at end of file
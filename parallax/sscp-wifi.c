@@ -21,8 +21,10 @@ static void ICACHE_FLASH_ATTR scan_complete(void *data, int count)
 
     if (flashConfig.sscp_events)
         send_scan_complete_event('!');
-    else
+    else {
         scanDone = 1;
+        sscp_postEvent(SSCP_EVENT_WIFI);
+    }
 }
 
 int ICACHE_FLASH_ATTR wifi_check_for_events(void)
@@ -30,12 +30,13 @@ static void ICACHE_FLASH_ATTR websocketRecvCb(Websock *ws, char *data, int len,
 {
 	sscp_connection *connection = (sscp_connection *)ws->userData;
     if (!(connection->flags & CONNECTION_RXFULL)) {
-        if (len > SSCP_RX_BUFFER_MAX)
-            len = SSCP_RX_BUFFER_MAX;
+        if (len > connection->rxSize)
+            len = connection->rxSize;
         os_memcpy(connection->rxBuffer, data, len);
         connection->rxCount = len;
         connection->rxIndex = 0;
         connection->flags |= CONNECTION_RXFULL;
+        sscp_postEvent(connection->hdr.handle);
         if (flashConfig.sscp_events)
             send_data_event(connection, '!');
     }
@@ -82,18 +83,18 @@ void ICACHE_FLASH_ATTR sscp_websocketConnect(Websock *ws)
 static void ICACHE_FLASH_ATTR send_connect_event(sscp_connection *connection, int prefix)
 {
     connection->flags &= ~CONNECTION_INIT;
-    sscp_sendResponse("W,%d,%d", connection->hdr.handle, connection->listenerHandle);
+    sscp_send(prefix, "W,%d,%d", connection->hdr.handle, connection->listenerHandle);
 }
 
 static void ICACHE_FLASH_ATTR send_disconnect_event(sscp_connection *connection, int prefix)
 {
     connection->flags &= ~CONNECTION_TERM;
-    sscp_sendResponse("X,%d,0", connection->hdr.handle);
+    sscp_send(prefix, "X,%d,0", connection->hdr.handle);
 }
 
 static void ICACHE_FLASH_ATTR send_data_event(sscp_connection *connection, int prefix)
 {
-    sscp_sendResponse("D,%d,%d", connection->hdr.handle, connection->rxCount);
+    sscp_send(prefix, "D,%d,%d", connection->hdr.handle, connection->rxCount);
 }
 
 static int ICACHE_FLASH_ATTR checkForEvents_handler(sscp_hdr *hdr)
@@ -140,11 +141,15 @@ static void ICACHE_FLASH_ATTR send_cb(void *data, int count)
     sscp_connection *connection = (sscp_connection *)data;
     Websock *ws = (Websock *)connection->d.ws.ws;
 
-    char sendBuff[1024];
-    httpdSetSendBuffer(ws->conn, sendBuff, sizeof(sendBuff));
-    cgiWebsocketSend(ws, connection->txBuffer, count, WEBSOCK_FLAG_NONE);
+    httpdSetConnSendBuffer(ws->conn);
     connection->flags &= ~CONNECTION_TXFULL;
 
+    // the send backlog is full: nothing was sent, so the MCU can send this again later
+    if (!cgiWebsocketSend(ws, connection->txBuffer, count, WEBSOCK_FLAG_NONE)) {
+        sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+        return;
+    }
+
     sscp_sendResponse("S,%d", count);
 }
 
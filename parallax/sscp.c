@@ -10,6 +10,9 @@
 #include "uart.h"
 #include "config.h"
 #include "cgiwifi.h"
+#include "crc16.h"
+#include "task.h"
+#include "gpio-helpers.h"
 
 //#define DUMP_CMDS
 //#define DUMP_ARGS
@@ -21,11 +24,121 @@
 
 #define SSCP_DEF_ENABLE     0
 
+#define SSCP_QUEUE_MAX      4
+#define SSCP_BATCH_MAX      112
+#define SSCP_EVENT_TEXT_MAX 24  // longest event text including the separator
+#define SSCP_PACED_MAX      256
+
+/*
+    Binary frames
+
+    A command frame starts with the start character followed by SSCP_TKN_FRAME:
+
+        start FRAME len-lo len-hi flags opcode arg... [crc-lo crc-hi]
+
+    len counts the bytes from flags through the last argument byte and the opcode
+    is one of the command tokens (SSCP_TKN_SEND, SSCP_TKN_RECV, etc.). Each argument
+    is a type byte followed by its value:
+
+        SSCP_TKN_INT8, SSCP_TKN_UINT8       1 byte
+        SSCP_TKN_INT16, SSCP_TKN_UINT16     2 bytes, little-endian
+        SSCP_TKN_INT32, SSCP_TKN_UINT32     4 bytes, little-endian
+        SSCP_TKN_STRING                     length byte followed by the characters
+        keyword tokens (SSCP_TKN_TCP, ...)  no value
+
+    If SSCP_FRAME_CRC is set in flags, the frame ends with the CRC16 of everything
+    from len-lo through the last argument byte. If SSCP_FRAME_SEQ is set in the
+    flags of a reply, a sequence number byte follows the flags (see below).
+
+    A command that arrives as a frame is answered with a frame of the same shape
+    where the opcode is replaced by the prefix ('=' or '!') and the status letter,
+    and each reply field is sent as either SSCP_TKN_INT32 or SSCP_TKN_STRING. Events
+    use the framing of the most recent command. SEND and RECV payloads follow the
+    frame as raw bytes exactly as they do in the text protocol.
+*/
+
+/*
+    Command pipelining
+
+    When cmd-pipeline is set, commands that arrive while another command is
+    still being processed are parsed and placed in a queue of SSCP_QUEUE_MAX
+    entries instead of being dropped. Queued commands run in order as soon
+    as the previous command has sent its reply. Every command is given a
+    sequence number (0-255, starting at zero after a reset) and each reply
+    carries the number of the command it answers:
+
+        =<seq>:S,0
+
+    Events are not tagged. The payload of a queued SEND or REPLY is staged
+    in a buffer until its command runs. Only one payload can be staged at a
+    time so a second payload command that arrives while the first is still
+    waiting is answered with SSCP_ERROR_BUSY when its turn comes, as is a
+    command that arrives while the queue is full.
+*/
+
+enum {
+    PAYLOAD_NONE,       // command has no payload
+    PAYLOAD_PENDING,    // payload is still arriving
+    PAYLOAD_STAGED,     // payload is in sscp_stage
+    PAYLOAD_DROPPED     // payload was discarded and the command will fail
+};
+
+typedef struct {
+    struct cmd_def *command;    // command selected by a leading token
+    int frame;                  // buffer holds a binary frame rather than text
+    int seq;
+    int payload;
+    int length;
+    uint8_t buffer[SSCP_BUFFER_MAX + 16];
+} sscp_queued_command;
+
+static sscp_queued_command sscp_queue[SSCP_QUEUE_MAX];
+static int sscp_queue_head;
+static int sscp_queue_count;
+static char sscp_stage[SSCP_TX_BUFFER_MAX];
+static int sscp_stage_length;
+static int sscp_stage_busy;     // a payload is being or has been staged
+static int sscp_stage_ready;    // staged payload belongs to the running command
+static int sscp_seq;            // sequence number of the next command
+static int sscp_current_seq;    // sequence number of the running command
+static uint8_t sscp_queue_task;
+
+// handles with unreported events in the order in which they were posted
+static uint8_t sscp_event_queue[SSCP_HANDLE_MAX + 1];
+static int sscp_event_count;
+static uint32_t sscp_event_queued;  // bit mask of the handles in sscp_event_queue
+
+/*
+    Paced transmitter
+
+    Slow receivers can ask for a pause after '\r' and the cmd-pause-chars
+    characters. Rather than stalling the whole system with os_delay_us, paced
+    replies go into a ring buffer that is written to the UART up to the next
+    pause character, after which an os_timer resumes sending once the FIFO has
+    had time to drain and the pause has elapsed. Payloads, binary frames and
+    unpaced replies first flush whatever is still waiting (blocking, as
+    before) so that bytes always leave in order.
+*/
+static char sscp_paced_buffer[SSCP_PACED_MAX];
+static int sscp_paced_head;
+static int sscp_paced_count;
+static int sscp_paced_waiting;  // a pause is in progress
+static uint32_t sscp_paced_resume;
+static os_timer_t sscp_paced_timer;
+
+// events collected by a POLL for a single reply
+static int sscp_batch;
+static int sscp_batch_count;
+static int sscp_batch_length;
+static char sscp_batch_buffer[SSCP_BATCH_MAX];
+
 enum {
     STATE_IDLE,
     STATE_PARSING,
     STATE_COLLECTING,
-    STATE_PAYLOAD
+    STATE_PAYLOAD,
+    STATE_FRAME_LENGTH,
+    STATE_FRAME
 };
 
 static int sscp_state;
@@ -34,6 +147,11 @@ static int sscp_token;
 static int sscp_separator;
 static uint8_t sscp_buffer[SSCP_BUFFER_MAX + 16]; // add some extra space for os_sprintf of numeric tokens
 static int sscp_length;
+static int sscp_frame_remaining;
+static int sscp_frame_mode;     // reply with frames rather than text
+static int sscp_frame_flags;    // flags of the most recent frame
+static char sscp_args[SSCP_BUFFER_MAX * 2]; // arguments decoded from a frame
+static struct cmd_def *sscp_command;  // command selected by a leading token
 
 static int sscp_processing;
 static char *sscp_payload;
@@ -43,7 +161,70 @@ static void (*sscp_payload_cb)(void *data, int count);
 static void *sscp_payload_data;
 
 sscp_listener sscp_listeners[SSCP_LISTENER_MAX];
-sscp_connection sscp_connections[SSCP_CONNECTION_MAX];
+sscp_connection *sscp_connections;
+
+/*
+    Listener index
+
+    Every HTTP and websocket request is matched against the listeners before
+    it can fall through to the file system, so the lookup doesn't scan the
+    table. Exact paths are kept in a hash table keyed on the whole path and
+    a request costs one hash of the URL and a short bucket chain. Paths that
+    end in '*' are kept in a list ordered by prefix length and are only
+    checked when there is no exact match. The URL is hashed once along the
+    way as the prefixes get longer, each prefix is compared by hash before
+    its string, and the longest matching prefix wins.
+*/
+#define SSCP_LISTENER_HASH_SIZE 16
+
+static sscp_listener *sscp_listener_hash[SSCP_LISTENER_HASH_SIZE];
+static sscp_listener *sscp_listener_wild;
+int sscp_connection_count;
+
+/*
+    Connection pool
+
+    The connection table and the buffers of the connections are allocated
+    at startup rather than being fixed in the image. cmd-connections sets
+    the number of connection handles and cmd-buffer-pool the size of the
+    arena from which a connection takes its receive and transmit buffers
+    when it is opened. The buffer size depends on the type of connection
+    (tcp-buffer-size, udp-buffer-size and http-buffer-size) so a deployment
+    can have many small UDP handles or a few full size TCP streams in the
+    same RAM. The arena is handed out first fit in SSCP_POOL_UNIT byte units
+    and a connection gives its buffers back when it is closed. The settings
+    take effect when the module restarts.
+*/
+#define SSCP_POOL_UNIT      64
+#define SSCP_POOL_MAX       (32 * 1024)
+#define SSCP_POOL_DEFAULT   (SSCP_CONNECTION_MAX * (SSCP_RX_BUFFER_MAX + SSCP_TX_BUFFER_MAX))
+#define SSCP_BUFFER_MIN     64
+
+static char *sscp_pool;
+static int sscp_pool_units;
+static int sscp_pool_used;
+static uint8_t sscp_pool_map[SSCP_POOL_MAX / SSCP_POOL_UNIT / 8];  // a bit for each unit in use
+
+/*
+    Idle connection reaper
+
+    A connection that neither the MCU nor the network has used for the idle
+    timeout of its type (http-idle-timeout, ws-idle-timeout, tcp-idle-timeout
+    and udp-idle-timeout, in seconds) is closed by a sweep
+    that runs every SSCP_REAP_INTERVAL ms, so a handle the MCU forgot about
+    doesn't hold a slot until the next reset. The handle reports
+    X,handle,17 right away when events are on and otherwise at the next
+    POLL. cmd-reaped counts the connections closed this way. A timeout of
+    zero selects the default for the type: SSCP_HTTP_IDLE_DEFAULT for HTTP,
+    never for the others. A timeout of -1 means never.
+*/
+#define SSCP_REAP_INTERVAL  5000
+#define SSCP_HTTP_IDLE_DEFAULT  60  // seconds, used when http-idle-timeout is zero
+#define SSCP_IDLE_MAX       3600    // seconds, system_get_time wraps after 71 minutes
+
+static os_timer_t sscp_reap_timer;
+static uint32_t sscp_reaped_handles;    // closed by the reaper but not reported yet
+uint32_t sscp_reaped_count;
 
 #if defined(DUMP_CMDS) || defined(DUMP_FILTER) || defined(DUMP_OUTOFBAND)
 #define DUMP
@@ -55,6 +236,12 @@ static void dump(char *tag, uint8_t *buf, int len);
 #define dump(tag, buf, len)
 #endif
 
+static void init_command_tables(void);
+static void init_pool(void);
+static void reap_timer_cb(void *data);
+static void update_event_pin(void);
+static void sscp_queue_handler(os_event_t *event);
+
 void ICACHE_FLASH_ATTR sscp_init(void)
 {
     int i;
@@ -62,12 +249,20 @@ void ICACHE_FLASH_ATTR sscp_init(void)
     os_memset(&sscp_listeners, 0, sizeof(sscp_listeners));
     for (i = 0; i < SSCP_LISTENER_MAX; ++i)
         sscp_listeners[i].hdr.handle = i + 1;
+    os_memset(sscp_listener_hash, 0, sizeof(sscp_listener_hash));
+    sscp_listener_wild = NULL;
     
-    os_memset(&sscp_connections, 0, sizeof(sscp_connections));
-    for (i = 0; i < SSCP_CONNECTION_MAX; ++i)
-        sscp_connections[i].hdr.handle = SSCP_LISTENER_MAX + i + 1;
+    init_pool();
+    
+    os_timer_disarm(&sscp_reap_timer);
+    os_timer_setfn(&sscp_reap_timer, reap_timer_cb, NULL);
+    os_timer_arm(&sscp_reap_timer, SSCP_REAP_INTERVAL, 1);
+    
+    init_command_tables();
+    sscp_queue_task = register_usr_task(sscp_queue_handler);
     
     sscp_reset();
+    sscp_initEventPin();
 }
 
 void ICACHE_FLASH_ATTR sscp_reset(void)
@@ -76,20 +271,46 @@ void ICACHE_FLASH_ATTR sscp_reset(void)
     
     for (i = 0; i < SSCP_LISTENER_MAX; ++i)
         sscp_close_listener(&sscp_listeners[i]);
-    for (i = 0; i < SSCP_CONNECTION_MAX; ++i)
+    for (i = 0; i < sscp_connection_count; ++i)
         sscp_close_connection(&sscp_connections[i]);
         
     sscp_processing = 0;
     sscp_state = STATE_IDLE;
     sscp_separator = -1;
     sscp_length = 0;
+    sscp_frame_mode = 0;
+    sscp_frame_flags = 0;
     sscp_payload = NULL;
     sscp_payload_length = 0;
     sscp_payload_remaining = 0;
+    sscp_queue_head = 0;
+    sscp_queue_count = 0;
+    sscp_stage_length = 0;
+    sscp_stage_busy = 0;
+    sscp_stage_ready = 0;
+    sscp_seq = 0;
+    sscp_current_seq = 0;
+    sscp_event_count = 0;
+    sscp_event_queued = 0;
+    sscp_reaped_handles = 0;
+    sscp_batch = 0;
+    cmds_cancel_wait(0);
+    update_event_pin();
 }
 
 void ICACHE_FLASH_ATTR sscp_capturePayload(char *buf, int length, void (*cb)(void *data, int count), void *data)
 {
+    // the payload of a queued command has already been received
+    if (sscp_stage_ready) {
+        if (length > sscp_stage_length)
+            length = sscp_stage_length;
+        os_memcpy(buf, sscp_stage, length);
+        sscp_stage_ready = 0;
+        sscp_stage_busy = 0;
+        (*cb)(data, length);
+        return;
+    }
+
     sscp_payload = buf;
     sscp_payload_length = length;
     sscp_payload_remaining = length;
@@ -104,7 +325,7 @@ sscp_hdr ICACHE_FLASH_ATTR *sscp_get_handle(int i)
     
     if (i >= 1 && i <= SSCP_LISTENER_MAX)
         hdr = (sscp_hdr *)&sscp_listeners[i - 1];
-    else if (i >= SSCP_LISTENER_MAX + 1 && i <= SSCP_LISTENER_MAX + SSCP_CONNECTION_MAX)
+    else if (i >= SSCP_LISTENER_MAX + 1 && i <= SSCP_LISTENER_MAX + sscp_connection_count)
         hdr = (sscp_hdr *)&sscp_connections[i - SSCP_LISTENER_MAX - 1];
     else
         return NULL;
@@ -112,6 +333,55 @@ sscp_hdr ICACHE_FLASH_ATTR *sscp_get_handle(int i)
     return hdr->type == TYPE_UNUSED ? NULL : hdr;
 }
 
+// FNV-1a
+#define PATH_HASH_INIT          2166136261u
+#define PATH_HASH_STEP(h, c)    (((h) ^ (uint8_t)(c)) * 16777619u)
+
+static uint32_t ICACHE_FLASH_ATTR path_hash(const char *path, int length)
+{
+    uint32_t hash = PATH_HASH_INIT;
+    while (--length >= 0)
+        hash = PATH_HASH_STEP(hash, *path++);
+    return hash;
+}
+
+static void ICACHE_FLASH_ATTR index_listener(sscp_listener *listener)
+{
+    int length = os_strlen(listener->path);
+    sscp_listener **pNext;
+
+    if (length > 0 && listener->path[length - 1] == '*') {
+        listener->prefixLength = length - 1;
+        listener->hash = path_hash(listener->path, listener->prefixLength);
+        for (pNext = &sscp_listener_wild; *pNext && (*pNext)->prefixLength <= listener->prefixLength; pNext = &(*pNext)->next)
+            ;
+    }
+    else {
+        listener->prefixLength = -1;
+        listener->hash = path_hash(listener->path, length);
+        pNext = &sscp_listener_hash[listener->hash % SSCP_LISTENER_HASH_SIZE];
+    }
+    listener->next = *pNext;
+    *pNext = listener;
+}
+
+static void ICACHE_FLASH_ATTR unindex_listener(sscp_listener *listener)
+{
+    sscp_listener **pNext;
+
+    if (listener->prefixLength >= 0)
+        pNext = &sscp_listener_wild;
+    else
+        pNext = &sscp_listener_hash[listener->hash % SSCP_LISTENER_HASH_SIZE];
+    for (; *pNext; pNext = &(*pNext)->next) {
+        if (*pNext == listener) {
+            *pNext = listener->next;
+            break;
+        }
+    }
+    listener->next = NULL;
+}
+
 sscp_listener *sscp_allocate_listener(int type, char *path, sscp_dispatch *dispatch)
 {
     int i;
@@ -121,6 +391,7 @@ sscp_listener *sscp_allocate_listener(int type, char *path, sscp_dispatch *dispa
             listener->hdr.type = type;
             listener->hdr.dispatch = dispatch;
             os_strcpy(listener->path, path);
+            index_listener(listener);
             return listener;
         }
     }
@@ -129,29 +400,35 @@ sscp_listener *sscp_allocate_listener(int type, char *path, sscp_dispatch *dispa
 
 sscp_listener ICACHE_FLASH_ATTR *sscp_find_listener(const char *path, int type)
 {
+    uint32_t hash = path_hash(path, os_strlen(path));
     sscp_listener *listener;
-    int i;
-
-    // find a matching listener
-    for (i = 0, listener = sscp_listeners; i < SSCP_LISTENER_MAX; ++i, ++listener) {
 
-        // only check channels to which the MCU is listening
-        if (listener->hdr.type == type) {
-
-            // check for a literal match
-            if (os_strcmp(listener->path, path) == 0) {
+    // check for a literal match
+    for (listener = sscp_listener_hash[hash % SSCP_LISTENER_HASH_SIZE]; listener; listener = listener->next) {
+        if (listener->hdr.type == type && listener->hash == hash && os_strcmp(listener->path, path) == 0) {
 sscp_log("listener: matching '%s' with '%s'", listener->path, path);
-                return listener;
-            }
-            
-            // check for a wildcard match
-            else {
-                int len_m1 = os_strlen(listener->path) - 1;
-                if (listener->path[len_m1] == '*' && os_strncmp(listener->path, path, len_m1) == 0) {
-sscp_log("listener: matching '%s' with '%s'", listener->path, path);
-                    return listener;
-                }
-            }
+            return listener;
+        }
+    }
+
+    // check for a wildcard match, the list is shortest prefix first
+    if ((listener = sscp_listener_wild) != NULL) {
+        sscp_listener *match = NULL;
+        int length = 0;
+        hash = PATH_HASH_INIT;
+        for (; listener; listener = listener->next) {
+            if (listener->hdr.type != type)
+                continue;
+            while (length < listener->prefixLength && path[length])
+                hash = PATH_HASH_STEP(hash, path[length++]);
+            if (length < listener->prefixLength)
+                break;
+            if (listener->hash == hash && os_strncmp(listener->path, path, length) == 0)
+                match = listener;
+        }
+        if (match) {
+sscp_log("listener: matching '%s' with '%s'", match->path, path);
+            return match;
         }
     }
 
@@ -161,27 +438,131 @@ sscp_log("listener: matching '%s' with '%s'", listener->path, path);
 
 void ICACHE_FLASH_ATTR sscp_close_listener(sscp_listener *listener)
 {
-    listener->hdr.type = TYPE_UNUSED;
+    if (listener->hdr.type != TYPE_UNUSED) {
+        if (listener->hdr.dispatch->close)
+            (*listener->hdr.dispatch->close)((sscp_hdr *)listener);
+        unindex_listener(listener);
+        listener->hdr.type = TYPE_UNUSED;
+    }
 }
 
 sscp_connection ICACHE_FLASH_ATTR *sscp_get_connection(int i)
 {
     sscp_connection *connection;
     
-    if (i >= SSCP_LISTENER_MAX + 1 && i <= SSCP_LISTENER_MAX + SSCP_CONNECTION_MAX)
+    if (i >= SSCP_LISTENER_MAX + 1 && i <= SSCP_LISTENER_MAX + sscp_connection_count)
         connection = &sscp_connections[i - SSCP_LISTENER_MAX - 1];
     else
         return NULL;
 
-    return connection->hdr.type == TYPE_UNUSED ? NULL : connection;
+    if (connection->hdr.type == TYPE_UNUSED)
+        return NULL;
+    
+    connection->lastActive = system_get_time();
+    return connection;
+}
+
+static void ICACHE_FLASH_ATTR init_pool(void)
+{
+    int count = flashConfig.sscp_connections > 0 ? flashConfig.sscp_connections : SSCP_CONNECTION_MAX;
+    int size = flashConfig.sscp_buffer_pool > 0 ? flashConfig.sscp_buffer_pool : SSCP_POOL_DEFAULT;
+    int i;
+
+    if (count > SSCP_CONNECTION_LIMIT)
+        count = SSCP_CONNECTION_LIMIT;
+    if (size > SSCP_POOL_MAX)
+        size = SSCP_POOL_MAX;
+
+    if (!(sscp_connections = (sscp_connection *)os_zalloc(count * sizeof(sscp_connection)))) {
+        os_printf("SSCP: no memory for %d connections\n", count);
+        count = 0;
+    }
+    for (i = 0; i < count; ++i)
+        sscp_connections[i].hdr.handle = SSCP_LISTENER_MAX + i + 1;
+    sscp_connection_count = count;
+
+    sscp_pool_units = size / SSCP_POOL_UNIT;
+    if (!(sscp_pool = (char *)os_malloc(sscp_pool_units * SSCP_POOL_UNIT))) {
+        os_printf("SSCP: no memory for a %d byte buffer pool\n", size);
+        sscp_pool_units = 0;
+    }
+    sscp_pool_used = 0;
+    os_memset(sscp_pool_map, 0, sizeof(sscp_pool_map));
+}
+
+static int ICACHE_FLASH_ATTR buffer_size(int type)
+{
+    int size;
+    switch (type) {
+    case TYPE_TCP_CONNECTION:
+        size = flashConfig.tcp_buffer_size;
+        break;
+    case TYPE_UDP_CONNECTION:
+        size = flashConfig.udp_buffer_size;
+        break;
+    default:
+        size = flashConfig.http_buffer_size;
+        break;
+    }
+    if (size <= 0 || size > SSCP_RX_BUFFER_MAX)
+        size = SSCP_RX_BUFFER_MAX;
+    else if (size < SSCP_BUFFER_MIN)
+        size = SSCP_BUFFER_MIN;
+    return size;
+}
+
+#define POOL_UNIT_USED(i)   (sscp_pool_map[(i) / 8] & (1 << ((i) % 8)))
+
+// returns the first unit of a free run of units or -1 if there is none
+static int ICACHE_FLASH_ATTR pool_alloc(int units)
+{
+    int start, i;
+    for (start = 0; start + units <= sscp_pool_units; start = i + 1) {
+        for (i = start; i < start + units && !POOL_UNIT_USED(i); ++i)
+            ;
+        if (i == start + units) {
+            for (i = start; i < start + units; ++i)
+                sscp_pool_map[i / 8] |= 1 << (i % 8);
+            sscp_pool_used += units;
+            return start;
+        }
+    }
+    return -1;
+}
+
+static void ICACHE_FLASH_ATTR pool_release(int start, int units)
+{
+    int i;
+    for (i = start; i < start + units; ++i)
+        sscp_pool_map[i / 8] &= ~(1 << (i % 8));
+    sscp_pool_used -= units;
+}
+
+// bytes of the buffer pool that aren't in use
+int ICACHE_FLASH_ATTR sscp_pool_free(void)
+{
+    return (sscp_pool_units - sscp_pool_used) * SSCP_POOL_UNIT;
 }
 
 sscp_connection ICACHE_FLASH_ATTR *sscp_allocate_connection(int type, sscp_dispatch *dispatch)
 {
+    int size = buffer_size(type);
+    int units = (2 * size + SSCP_POOL_UNIT - 1) / SSCP_POOL_UNIT;
     int i;
-    for (i = 0; i < SSCP_CONNECTION_MAX; ++i) {
+    for (i = 0; i < sscp_connection_count; ++i) {
         sscp_connection *connection = &sscp_connections[i];
         if (connection->hdr.type == TYPE_UNUSED) {
+            int start;
+            if ((start = pool_alloc(units)) < 0) {
+                sscp_log("SSCP: buffer pool can't hold %d more bytes, %d free", 2 * size, sscp_pool_free());
+                return NULL;
+            }
+            connection->poolIndex = start;
+            connection->poolUnits = units;
+            connection->rxBuffer = sscp_pool + start * SSCP_POOL_UNIT;
+            connection->rxSize = size;
+            connection->txBuffer = connection->rxBuffer + size;
+            connection->txSize = size;
             connection->hdr.type = type;
             connection->hdr.dispatch = dispatch;
             connection->flags = CONNECTION_INIT;
@@ -190,7 +571,9 @@ sscp_connection ICACHE_FLASH_ATTR *sscp_allocate_connection(int type, sscp_dispa
             connection->rxIndex = 0;
             connection->txCount = 0;
             connection->txIndex = 0;
+            connection->lastActive = system_get_time();
             os_memset(&connection->d, 0, sizeof(connection->d));
+            sscp_postEvent(connection->hdr.handle);
             return connection;
         }
     }
@@ -202,64 +585,339 @@ void ICACHE_FLASH_ATTR sscp_close_connection(sscp_connection *connection)
     if (connection->hdr.type != TYPE_UNUSED) {
         if (connection->hdr.dispatch->close)
             (*connection->hdr.dispatch->close)((sscp_hdr *)connection);
+        sscp_free_connection(connection);
+    }
+}
+
+// idle timeout in seconds for a connection type, 0 for never
+static int ICACHE_FLASH_ATTR idle_timeout(int type)
+{
+    int timeout;
+    switch (type) {
+    case TYPE_HTTP_CONNECTION:
+        timeout = flashConfig.http_idle_timeout;
+        if (timeout == 0)
+            timeout = SSCP_HTTP_IDLE_DEFAULT;
+        break;
+    case TYPE_WEBSOCKET_CONNECTION:
+        timeout = flashConfig.ws_idle_timeout;
+        break;
+    case TYPE_TCP_CONNECTION:
+        timeout = flashConfig.tcp_idle_timeout;
+        break;
+    case TYPE_UDP_CONNECTION:
+        timeout = flashConfig.udp_idle_timeout;
+        break;
+    default:
+        timeout = 0;
+        break;
+    }
+    if (timeout < 0)
+        timeout = 0;
+    else if (timeout > SSCP_IDLE_MAX)
+        timeout = SSCP_IDLE_MAX;
+    return timeout;
+}
+
+static void ICACHE_FLASH_ATTR reap_timer_cb(void *data)
+{
+    uint32_t now = system_get_time();
+    int i;
+
+    for (i = 0; i < sscp_connection_count; ++i) {
+        sscp_connection *connection = &sscp_connections[i];
+        int handle = connection->hdr.handle;
+        int timeout;
+
+        if (connection->hdr.type == TYPE_UNUSED || !(timeout = idle_timeout(connection->hdr.type)))
+            continue;
+
+        // a payload may still be on its way into txBuffer
+        if (now - connection->lastActive < (uint32_t)timeout * 1000000
+        ||  (sscp_state == STATE_PAYLOAD && sscp_payload_data == connection))
+            continue;
+
+        sscp_log("Reaping %d after %d seconds idle", handle, timeout);
+        sscp_close_connection(connection);
+        ++sscp_reaped_count;
+
+        if (flashConfig.sscp_events)
+            sscp_send('!', "X,%d,%d", handle, SSCP_ERROR_TIMEOUT);
+        else {
+            sscp_reaped_handles |= 1 << handle;
+            sscp_postEvent(handle);
+        }
+    }
+}
+
+// release the slot and buffers of a connection without telling its protocol
+void ICACHE_FLASH_ATTR sscp_free_connection(sscp_connection *connection)
+{
+    if (connection->hdr.type != TYPE_UNUSED) {
+        pool_release(connection->poolIndex, connection->poolUnits);
+        connection->rxBuffer = connection->txBuffer = NULL;
+        connection->rxSize = connection->txSize = 0;
         connection->hdr.type = TYPE_UNUSED;
     }
 }
 
+static int ICACHE_FLASH_ATTR is_pause_char(int byte)
+{
+    int i;
+    if (byte == '\r')
+        return 1;
+    for (i = 0; i < flashConfig.sscp_need_pause_cnt; ++i) {
+        if (byte == flashConfig.sscp_need_pause[i])
+            return 1;
+    }
+    return 0;
+}
+
+static int ICACHE_FLASH_ATTR paced_next_byte(void)
+{
+    int byte = sscp_paced_buffer[sscp_paced_head];
+    sscp_paced_head = (sscp_paced_head + 1) % SSCP_PACED_MAX;
+    --sscp_paced_count;
+    return byte;
+}
+
+// send paced bytes up to and including the next pause character
+static void ICACHE_FLASH_ATTR paced_send(void *data)
+{
+    sscp_paced_waiting = 0;
+    
+    while (sscp_paced_count > 0) {
+        int byte = paced_next_byte();
+        uart_tx_one_char(UART0, byte);
+        if (is_pause_char(byte)) {
+            // allow about ten bit times for each character still in the ring or FIFO, which
+            // includes anything queued before this burst, to go out before the pause starts
+            uint32_t delay = (uint32_t)((uint64_t)uart0_tx_pending() * 10000000 / flashConfig.baud_rate) + flashConfig.sscp_pause_time_ms * 1000;
+            sscp_paced_resume = system_get_time() + delay;
+            sscp_paced_waiting = 1;
+            os_timer_disarm(&sscp_paced_timer);
+            os_timer_setfn(&sscp_paced_timer, paced_send, NULL);
+            os_timer_arm(&sscp_paced_timer, (delay + 999) / 1000, 0);
+            break;
+        }
+    }
+}
+
+// send everything that is still waiting, pausing the old way
+static void ICACHE_FLASH_ATTR paced_flush(void)
+{
+    if (sscp_paced_waiting) {
+        int32_t remaining = (int32_t)(sscp_paced_resume - system_get_time());
+        os_timer_disarm(&sscp_paced_timer);
+        sscp_paced_waiting = 0;
+        if (remaining > 0)
+            os_delay_us(remaining);
+    }
+    while (sscp_paced_count > 0) {
+        int byte = paced_next_byte();
+        uart_tx_one_char(UART0, byte);
+        if (is_pause_char(byte)) {
+            uart_drain_tx_buffer(UART0);
+            os_delay_us(flashConfig.sscp_pause_time_ms * 1000);
+        }
+    }
+}
+
+static void ICACHE_FLASH_ATTR paced_write(char *buf, int cnt)
+{
+    // make room if necessary
+    if (sscp_paced_count + cnt > SSCP_PACED_MAX)
+        paced_flush();
+        
+    while (--cnt >= 0) {
+        sscp_paced_buffer[(sscp_paced_head + sscp_paced_count) % SSCP_PACED_MAX] = *buf++;
+        ++sscp_paced_count;
+    }
+    
+    if (!sscp_paced_waiting)
+        paced_send(NULL);
+}
+
+static int ICACHE_FLASH_ATTR put_int32(uint8_t *buf, int cnt, int32_t value)
+{
+    buf[cnt++] = SSCP_TKN_INT32;
+    buf[cnt++] = value;
+    buf[cnt++] = value >> 8;
+    buf[cnt++] = value >> 16;
+    buf[cnt++] = value >> 24;
+    return cnt;
+}
+
+static int ICACHE_FLASH_ATTR put_string(uint8_t *buf, int cnt, int max, const char *str, int length)
+{
+    if (length > 255)
+        length = 255;
+    if (cnt + 2 + length > max)
+        length = max - cnt - 2;
+    if (length < 0)
+        return cnt;
+    buf[cnt++] = SSCP_TKN_STRING;
+    buf[cnt++] = length;
+    os_memcpy(&buf[cnt], str, length);
+    return cnt + length;
+}
+
+// encode a response as a binary frame using the format string only to find the field types
+static void ICACHE_FLASH_ATTR sendFrameToMCU(int prefix, char *fmt, va_list ap)
+{
+    uint8_t buf[128];
+    int max = sizeof(buf) - 2; // leave room for the CRC
+    char *p = fmt;
+    int cnt, length;
+
+    // insert the header (the length is filled in below)
+    buf[0] = flashConfig.sscp_start;
+    buf[1] = SSCP_TKN_FRAME;
+    buf[4] = sscp_frame_flags & SSCP_FRAME_CRC;
+    cnt = 5;
+    if (flashConfig.sscp_pipeline && prefix == '=') {
+        buf[4] |= SSCP_FRAME_SEQ;
+        buf[cnt++] = sscp_current_seq;
+    }
+    buf[cnt++] = prefix;
+    buf[cnt++] = *p ? *p++ : 'S';
+
+    // insert each comma separated field
+    while (*p == ',' && cnt + 5 <= max) {
+        char *field = ++p;
+        while (*p != '\0' && *p != ',')
+            ++p;
+        if (*field == '%') {
+            char *spec = field + 1;
+            while (spec < p && (isdigit((int)*spec) || *spec == 'l' || *spec == '-'))
+                ++spec;
+            switch (*spec) {
+            case 'd':
+            case 'i':
+            case 'u':
+            case 'x':
+                cnt = put_int32(buf, cnt, va_arg(ap, int));
+                break;
+            case 's':
+                {
+                    char *str = va_arg(ap, char *);
+                    cnt = put_string(buf, cnt, max, str, os_strlen(str));
+                }
+                break;
+            default:
+                // unsupported conversion
+                break;
+            }
+        }
+        else {
+            int32_t value = 0;
+            char *q = field;
+            while (q < p && isdigit((int)*q))
+                value = value * 10 + *q++ - '0';
+            if (q == p && q > field)
+                cnt = put_int32(buf, cnt, value);
+            else
+                cnt = put_string(buf, cnt, max, field, p - field);
+        }
+    }
+
+    // fill in the length of everything after the length field
+    length = cnt - 4;
+    buf[2] = length;
+    buf[3] = length >> 8;
+
+    if (sscp_frame_flags & SSCP_FRAME_CRC) {
+        unsigned short crc = crc16_data(&buf[2], cnt - 2, 0);
+        buf[cnt++] = crc;
+        buf[cnt++] = crc >> 8;
+    }
+
+    sscp_log("%s: frame, %d bytes", prefix == '!' ? "Event" : "Reply", cnt);
+
+    // pauses after characters are a text protocol feature and don't apply to frames
+    paced_flush();
+    uart_tx_buffer(UART0, (char *)buf, cnt);
+
+    // events can go out while a command is still waiting for its reply
+    if (prefix == '=') {
+        sscp_processing = 0;
+        if (sscp_queue_count > 0)
+            post_usr_task(sscp_queue_task, 0);
+    }
+}
+
+// add a response to the events being collected by POLL
+static void ICACHE_FLASH_ATTR addToBatch(char *fmt, va_list ap)
+{
+    int cnt;
+    
+    if (sscp_batch_count > 0)
+        sscp_batch_buffer[sscp_batch_length++] = ';';
+        
+    cnt = ets_vsnprintf(&sscp_batch_buffer[sscp_batch_length], sizeof(sscp_batch_buffer) - sscp_batch_length, fmt, ap);
+    
+    // check to see if the event was truncated
+    if (sscp_batch_length + cnt >= sizeof(sscp_batch_buffer))
+        cnt = sizeof(sscp_batch_buffer) - sscp_batch_length - 1;
+        
+    sscp_batch_length += cnt;
+    ++sscp_batch_count;
+}
+
 static void ICACHE_FLASH_ATTR sendToMCU(int prefix, char *fmt, va_list ap)
 {
     char buf[128];
-    int cnt;
+    int hdrcnt, cnt;
+
+    if (sscp_batch && prefix == '=') {
+        addToBatch(fmt, ap);
+        return;
+    }
+
+    if (sscp_frame_mode) {
+        sendFrameToMCU(prefix, fmt, ap);
+        return;
+    }
 
     // insert the header
     buf[0] = flashConfig.sscp_start;
     buf[1] = prefix;
+    hdrcnt = 2;
+
+    // tag responses with the sequence number of the command when pipelining
+    if (flashConfig.sscp_pipeline && prefix == '=')
+        hdrcnt += os_sprintf(&buf[2], "%d:", sscp_current_seq);
 
     // insert the formatted response
-    cnt = ets_vsnprintf(&buf[2], sizeof(buf) - 3, fmt, ap);
+    cnt = ets_vsnprintf(&buf[hdrcnt], sizeof(buf) - hdrcnt - 1, fmt, ap);
 
     // check to see if the response was truncated
-    if (cnt >= sizeof(buf) - 3)
-        cnt = sizeof(buf) - 3 - 1;
+    if (cnt >= sizeof(buf) - hdrcnt - 1)
+        cnt = sizeof(buf) - hdrcnt - 1 - 1;
 
     // display the response before inserting the final \r
     sscp_log("%s: '%s'", buf[1] == '!' ? "Event" : "Reply", &buf[1]);
 
     // terminate the response with a \r
-    buf[2 + cnt] = '\r';
-    cnt += 3;
+    buf[hdrcnt + cnt] = '\r';
+    cnt += hdrcnt + 1;
 
     // handle inserting pauses after certain characters
-    if (flashConfig.sscp_pause_time_ms > 0) {
-        char *p = buf;
-        while (--cnt >= 0) {
-            int needPause = 0;
-            int byte = *p++;
-            uart_tx_one_char(UART0, byte);
-            if (byte == '\r')
-                needPause = 1;
-            else {
-                int i;
-                for (i = 0; i < flashConfig.sscp_need_pause_cnt; ++i) {
-                    if (byte == flashConfig.sscp_need_pause[i]) {
-                        needPause = 1;
-                        break;
-                    }
-                }
-            }
-            if (needPause) {
-                uart_drain_tx_buffer(UART0);
-                os_delay_us(flashConfig.sscp_pause_time_ms * 1000);
-            }
-        }
-    }
+    if (flashConfig.sscp_pause_time_ms > 0)
+        paced_write(buf, cnt);
 
     // no pauses after characters needed
     else {
+        paced_flush();
         uart_tx_buffer(UART0, buf, cnt);
     }
     
-    sscp_processing = 0;
+    // events can go out while a command is still waiting for its reply
+    if (prefix == '=') {
+        sscp_processing = 0;
+        if (sscp_queue_count > 0)
+            post_usr_task(sscp_queue_task, 0);
+    }
 }
 
 void ICACHE_FLASH_ATTR sscp_send(int prefix, char *fmt, ...)
@@ -280,9 +938,139 @@ void ICACHE_FLASH_ATTR sscp_sendResponse(char *fmt, ...)
 
 void ICACHE_FLASH_ATTR sscp_sendPayload(char *buf, int cnt)
 {
+    paced_flush();
     uart_tx_buffer(UART0, buf, cnt);
 }
 
+/*
+    Pending events
+
+    Connections post their handle here whenever they have a new event for the
+    MCU. POLL reports events in the order in which their handles were posted.
+    After a handle has reported an event it goes to the end of the queue so
+    one busy connection can't starve the others. A handle with nothing left
+    to report is simply dropped when it comes up again.
+*/
+
+/*
+    The event pin is a doorbell for MCUs that would rather wait on a pin than
+    poll. It is high whenever the queue is not empty. Handles are dropped from
+    the queue lazily so the pin can stay high after the MCU has consumed an
+    event with RECV until the next POLL finds nothing left to report. GPIO0
+    is a boot strapping pin so 0 means there is no event pin.
+*/
+
+static int ICACHE_FLASH_ATTR event_pin_valid(void)
+{
+    int pin = flashConfig.sscp_event_pin;
+    return pin > 0 && pin <= 15;
+}
+
+void ICACHE_FLASH_ATTR sscp_initEventPin(void)
+{
+    if (event_pin_valid()) {
+        makeGpio(flashConfig.sscp_event_pin);
+        update_event_pin();
+    }
+}
+
+static void ICACHE_FLASH_ATTR update_event_pin(void)
+{
+    if (event_pin_valid())
+        GPIO_OUTPUT_SET(flashConfig.sscp_event_pin, sscp_event_count > 0 ? 1 : 0);
+}
+
+void ICACHE_FLASH_ATTR sscp_postEvent(int handle)
+{
+    if (handle > SSCP_LISTENER_MAX && handle <= SSCP_LISTENER_MAX + sscp_connection_count)
+        sscp_connections[handle - SSCP_LISTENER_MAX - 1].lastActive = system_get_time();
+    if (handle < 0 || handle > SSCP_HANDLE_MAX || (sscp_event_queued & (1 << handle)))
+        return;
+    sscp_event_queue[sscp_event_count++] = handle;
+    sscp_event_queued |= 1 << handle;
+    update_event_pin();
+    cmds_wake_wait();
+}
+
+static int ICACHE_FLASH_ATTR reportEvent(int handle)
+{
+    sscp_hdr *hdr;
+    
+    if (handle == SSCP_EVENT_WIFI)
+        return wifi_check_for_events();
+        
+    // the slot may have been reused since, its own events are reported next time
+    if (sscp_reaped_handles & (1 << handle)) {
+        sscp_reaped_handles &= ~(1 << handle);
+        sscp_send('=', "X,%d,%d", handle, SSCP_ERROR_TIMEOUT);
+        return 1;
+    }
+        
+    if (!(hdr = sscp_get_handle(handle)) || !hdr->dispatch->checkForEvents)
+        return 0;
+        
+    return (*hdr->dispatch->checkForEvents)(hdr);
+}
+
+// report the oldest pending event from a handle in mask (wi-fi events are always reported)
+int ICACHE_FLASH_ATTR sscp_checkForEvents(uint32_t mask)
+{
+    int i = 0;
+    
+    while (i < sscp_event_count) {
+        int handle = sscp_event_queue[i];
+        
+        // leave events from handles the MCU didn't ask about in the queue
+        if (handle != SSCP_EVENT_WIFI && !((1 << handle) & mask)) {
+            ++i;
+            continue;
+        }
+        
+        // remove the handle from the queue
+        os_memmove(&sscp_event_queue[i], &sscp_event_queue[i + 1], sscp_event_count - i - 1);
+        --sscp_event_count;
+        sscp_event_queued &= ~(1 << handle);
+        
+        // move the handle to the end of the queue in case it has more to report
+        if (reportEvent(handle)) {
+            sscp_postEvent(handle);
+            return 1;
+        }
+    }
+    
+    update_event_pin();
+    return 0;
+}
+
+// start collecting POLL events for a single reply and return how many can be collected
+int ICACHE_FLASH_ATTR sscp_beginBatch(int max)
+{
+    // binary frames have no way to separate events so they are sent one at a time as usual
+    if (sscp_frame_mode || max < 1)
+        max = 1;
+    sscp_batch = !sscp_frame_mode;
+    sscp_batch_count = 0;
+    sscp_batch_length = 0;
+    return max;
+}
+
+int ICACHE_FLASH_ATTR sscp_batchFull(void)
+{
+    return sscp_batch_length + SSCP_EVENT_TEXT_MAX > sizeof(sscp_batch_buffer);
+}
+
+// send the collected events as one reply and return the number of events sent
+int ICACHE_FLASH_ATTR sscp_endBatch(void)
+{
+    int count = sscp_batch_count;
+    sscp_batch = 0;
+    if (count > 0) {
+        sscp_batch_buffer[sscp_batch_length] = '\0';
+        sscp_sendResponse("%s", sscp_batch_buffer);
+    }
+    return count;
+}
+
 void ICACHE_FLASH_ATTR sscp_sendEvent(char *fmt, ...)
 {
     va_list ap;
@@ -301,72 +1089,202 @@ void ICACHE_FLASH_ATTR sscp_log(char *fmt, ...)
     os_printf("[%u] %s\n", system_get_time() / 1000, buf);
 }
 
-typedef struct {
+typedef struct cmd_def {
     char *cmd;
     void (*handler)(int argc, char *argv[]);
+    int token;
+    int payloadArgc;    // last argument is a payload size when there are at least this many
 } cmd_def;
 static cmd_def cmds[] = {
-{   "",                 cmds_do_nothing     },
-{   "JOIN",             cmds_do_join        },
-{   "CHECK",            cmds_do_get         },
-{   "SET",              cmds_do_set         },
-{   "LISTEN",           cmds_do_listen      },
-{   "POLL",             cmds_do_poll        },
-{   "PATH",             cmds_do_path        },
-{   "SEND",             cmds_do_send        },
-{   "RECV",             cmds_do_recv        },
-{   "CLOSE",            cmds_do_close       },
-{   "RESTART",          cmds_do_restart     },
-{   "SLEEP",            cmds_do_sleep       },
-{   "LOCK",             cmds_do_lock        },
-{   "ARG",              http_do_arg         },
-{   "REPLY",            http_do_reply       },
-{   "CONNECT",          tcp_do_connect      },
-{   "UDP",              udp_do_connect      },
-{   "APSCAN",           wifi_do_apscan      },
-{   "APGET",            wifi_do_apget       },
-{   "CREGET",           wifi_do_creget      },
-{   "FINFO",            fs_do_finfo         },
-{   "FCOUNT",           fs_do_fcount        },
-{   "FRUN",             fs_do_frun          },
-{   "SAVECFG",          cmds_do_savecfg     },
-{   "DEFACFG",          cmds_do_defaultcfg  },
-{   NULL,               NULL                }
+{   "",                 cmds_do_nothing,    0,                    0   },
+{   "JOIN",             cmds_do_join,       SSCP_TKN_JOIN,        0   },
+{   "CHECK",            cmds_do_get,        SSCP_TKN_CHECK,       0   },
+{   "SET",              cmds_do_set,        SSCP_TKN_SET,         0   },
+{   "LISTEN",           cmds_do_listen,     SSCP_TKN_LISTEN,      0   },
+{   "POLL",             cmds_do_poll,       SSCP_TKN_POLL,        0   },
+{   "PATH",             cmds_do_path,       SSCP_TKN_PATH,        0   },
+{   "SEND",             cmds_do_send,       SSCP_TKN_SEND,        3   },
+{   "RECV",             cmds_do_recv,       SSCP_TKN_RECV,        0   },
+{   "CLOSE",            cmds_do_close,      SSCP_TKN_CLOSE,       0   },
+{   "RESTART",          cmds_do_restart,    SSCP_TKN_RESTART,     0   },
+{   "SLEEP",            cmds_do_sleep,      SSCP_TKN_SLEEP,       0   },
+{   "LOCK",             cmds_do_lock,       SSCP_TKN_LOCK,        0   },
+{   "ARG",              http_do_arg,        SSCP_TKN_ARG,         0   },
+{   "REPLY",            http_do_reply,      SSCP_TKN_REPLY,       4   },
+{   "CONNECT",          tcp_do_connect,     SSCP_TKN_CONNECT,     0   },
+{   "UDP",              udp_do_connect,     SSCP_TKN_UDP,         0   },
+{   "APSCAN",           wifi_do_apscan,     SSCP_TKN_APSCAN,      0   },
+{   "APGET",            wifi_do_apget,      SSCP_TKN_APGET,       0   },
+{   "CREGET",           wifi_do_creget,     SSCP_TKN_CREGET,      0   },
+{   "FINFO",            fs_do_finfo,        SSCP_TKN_FINFO,       0   },
+{   "FCOUNT",           fs_do_fcount,       SSCP_TKN_FCOUNT,      0   },
+{   "FRUN",             fs_do_frun,         SSCP_TKN_FRUN,        0   },
+{   "SAVECFG",          cmds_do_savecfg,    SSCP_TKN_SAVECFG,     0   },
+{   "DEFACFG",          cmds_do_defaultcfg, SSCP_TKN_DEFACFG,     0   },
+{   "WAIT",             cmds_do_wait,       SSCP_TKN_WAIT,        0   },
+{   "TCPOPT",           tcp_do_opt,         SSCP_TKN_TCPOPT,      0   },
+{   "SENDTO",           udp_do_sendto,      SSCP_TKN_SENDTO,      5   },
+{   "RECVFROM",         udp_do_recvfrom,    SSCP_TKN_RECVFROM,    0   },
+{   NULL,               NULL,               0,                    0   }
 };
 
-static void ICACHE_FLASH_ATTR sscp_process(char *buf, short len)
+// command tokens are all >= SSCP_MIN_TOKEN so this table is indexed by (token - SSCP_MIN_TOKEN)
+#define SSCP_TOKEN_COUNT    128
+static cmd_def *token_cmds[SSCP_TOKEN_COUNT];
+
+/*
+    Text commands are found with a perfect hash of the first character, the
+    last character and the length of the command name. The multipliers were
+    chosen so that no two names in cmds[] collide. The table is built by the
+    compiler from the same macro used for the lookup and holds the index of
+    the matching cmds[] entry plus one so that zero marks an empty slot. A
+    single strcmp then confirms the match. sscp_init verifies the table so a
+    command added without a slot here, or one that collides, is reported.
+*/
+#define CMD_HASH_SIZE       64
+#define CMD_HASH(first, last, length)   (((first) + 4 * (last) + 7 * (length)) & (CMD_HASH_SIZE - 1))
+
+static const uint8_t cmd_hash[CMD_HASH_SIZE] = {
+    [CMD_HASH('J', 'N', 4)] =  1,   // JOIN
+    [CMD_HASH('C', 'K', 5)] =  2,   // CHECK
+    [CMD_HASH('S', 'T', 3)] =  3,   // SET
+    [CMD_HASH('L', 'N', 6)] =  4,   // LISTEN
+    [CMD_HASH('P', 'L', 4)] =  5,   // POLL
+    [CMD_HASH('P', 'H', 4)] =  6,   // PATH
+    [CMD_HASH('S', 'D', 4)] =  7,   // SEND
+    [CMD_HASH('R', 'V', 4)] =  8,   // RECV
+    [CMD_HASH('C', 'E', 5)] =  9,   // CLOSE
+    [CMD_HASH('R', 'T', 7)] = 10,   // RESTART
+    [CMD_HASH('S', 'P', 5)] = 11,   // SLEEP
+    [CMD_HASH('L', 'K', 4)] = 12,   // LOCK
+    [CMD_HASH('A', 'G', 3)] = 13,   // ARG
+    [CMD_HASH('R', 'Y', 5)] = 14,   // REPLY
+    [CMD_HASH('C', 'T', 7)] = 15,   // CONNECT
+    [CMD_HASH('U', 'P', 3)] = 16,   // UDP
+    [CMD_HASH('A', 'N', 6)] = 17,   // APSCAN
+    [CMD_HASH('A', 'T', 5)] = 18,   // APGET
+    [CMD_HASH('C', 'T', 6)] = 19,   // CREGET
+    [CMD_HASH('F', 'O', 5)] = 20,   // FINFO
+    [CMD_HASH('F', 'T', 6)] = 21,   // FCOUNT
+    [CMD_HASH('F', 'N', 4)] = 22,   // FRUN
+    [CMD_HASH('S', 'G', 7)] = 23,   // SAVECFG
+    [CMD_HASH('D', 'G', 7)] = 24,   // DEFACFG
+    [CMD_HASH('W', 'T', 4)] = 25,   // WAIT
+    [CMD_HASH('T', 'T', 6)] = 26,   // TCPOPT
+    [CMD_HASH('S', 'O', 6)] = 27,   // SENDTO
+    [CMD_HASH('R', 'M', 8)] = 28    // RECVFROM
+};
+
+static cmd_def ICACHE_FLASH_ATTR *find_command(const char *name)
 {
-    char *argv[SSCP_MAX_ARGS + 1];
-    cmd_def *def = NULL;
-    char *p, *next;
-    int argc, i;
-    
-#ifdef DUMP_CMDS
-    dump("sscp", (uint8_t *)buf, len);
+    int length = os_strlen(name);
+    cmd_def *def;
+    int index;
+
+    // the empty command is the only one with a zero length name
+    if (length == 0)
+        return &cmds[0];
+
+    if (!(index = cmd_hash[CMD_HASH((uint8_t)name[0], (uint8_t)name[length - 1], length)]))
+        return NULL;
+
+    def = &cmds[index - 1];
+    return os_strcmp(name, def->cmd) == 0 ? def : NULL;
+}
+
+static void ICACHE_FLASH_ATTR init_command_tables(void)
+{
+    cmd_def *def;
+
+    os_memset(token_cmds, 0, sizeof(token_cmds));
+    for (def = cmds; def->cmd; ++def) {
+        if (def->token >= SSCP_MIN_TOKEN)
+            token_cmds[def->token - SSCP_MIN_TOKEN] = def;
+        if (find_command(def->cmd) != def)
+            os_printf("SSCP: '%s' is missing from the command hash table\n", def->cmd);
+    }
+}
+
+// keyword tokens stand for an argument rather than a command
+static const struct {
+    int token;
+    char *name;
+} keyword_tokens[] = {
+{   SSCP_TKN_HTTP,      "HTTP"      },
+{   SSCP_TKN_WS,        "WS"        },
+{   SSCP_TKN_TCP,       "TCP"       },
+{   SSCP_TKN_STA,       "STA"       },
+{   SSCP_TKN_AP,        "AP"        },
+{   SSCP_TKN_STA_AP,    "STA+AP"    },
+{   0,                  NULL        }
+};
+
+// spell out a command or keyword token, NULL for any other byte
+static char ICACHE_FLASH_ATTR *token_name(int token, int *pSep)
+{
+    int i;
+
+    if (token < SSCP_MIN_TOKEN)
+        return NULL;
+
+    // commands are named in cmds[] and are followed by the ':' that starts their arguments
+    if (token_cmds[token - SSCP_MIN_TOKEN]) {
+        if (pSep)
+            *pSep = ':';
+        return token_cmds[token - SSCP_MIN_TOKEN]->cmd;
+    }
+
+    for (i = 0; keyword_tokens[i].name; ++i) {
+        if (keyword_tokens[i].token == token) {
+            if (pSep)
+                *pSep = ',';
+            return keyword_tokens[i].name;
+        }
+    }
+
+    return NULL;
+}
+
+static void ICACHE_FLASH_ATTR sscp_dispatch_command(cmd_def *def, int argc, char *argv[])
+{
+#ifdef DUMP_ARGS
+    int i;
+    for (i = 0; i < argc; ++i)
+        os_printf("argv[%d] = '%s'\n", i, argv[i]);
 #endif
+
+    sscp_processing = 1;
+    sscp_log("Calling '%s' handler", def->cmd);
+    (*def->handler)(argc, argv);
+}
+
+// split a text command into arguments and find its handler
+static int ICACHE_FLASH_ATTR parse_command(cmd_def *command, char *buf, cmd_def **pDef, int *pArgc, char *argv[])
+{
+    cmd_def *def;
+    char *p, *next;
+    int argc;
     
     p = buf;
     argc = 0;
     
-    if (!(next = os_strchr(p, ':')))
-        next = &p[os_strlen(p)];
-    else
-        *next++ = '\0';
-                
-    argv[argc++] = p;
-    p = next;
-    
-    for (i = 0; cmds[i].cmd; ++i) {
-        if (strcmp(argv[0], cmds[i].cmd) == 0) {
-            def = &cmds[i];
-            break;
-        }
-    }
+    // commands that started with a token were looked up by the filter and the buffer only holds the arguments
+    if ((def = command) != NULL)
+        argv[argc++] = def->cmd;
     
-    if (!def) {
-        os_printf("No handler for '%s'\n", argv[0]);
-        sscp_sendResponse("E,%d", SSCP_ERROR_INVALID_REQUEST);
-        return;
+    else {
+        if (!(next = os_strchr(p, ':')))
+            next = &p[os_strlen(p)];
+        else
+            *next++ = '\0';
+                    
+        argv[argc++] = p;
+        p = next;
+    
+        if (!(def = find_command(argv[0]))) {
+            os_printf("No handler for '%s'\n", argv[0]);
+            return SSCP_ERROR_INVALID_REQUEST;
+        }
     }
     
     if (*p) {
@@ -383,15 +1301,313 @@ static void ICACHE_FLASH_ATTR sscp_process(char *buf, short len)
     }
         
     argv[argc] = NULL;
+    
+    *pDef = def;
+    *pArgc = argc;
+    return 0;
+}
+
+static void ICACHE_FLASH_ATTR sscp_process(cmd_def *command, char *buf, short len)
+{
+    char *argv[SSCP_MAX_ARGS + 1];
+    cmd_def *def;
+    int argc, error;
+    
+#ifdef DUMP_CMDS
+    dump("sscp", (uint8_t *)buf, len);
+#endif
+    
+    sscp_frame_mode = 0;
+    
+    if ((error = parse_command(command, buf, &def, &argc, argv)) != 0) {
+        sscp_sendResponse("E,%d", error);
+        return;
+    }
         
-#ifdef DUMP_ARGS
-    for (i = 0; i < argc; ++i)
-        os_printf("argv[%d] = '%s'\n", i, argv[i]);
+    sscp_dispatch_command(def, argc, argv);
+}
+
+// format a 32 bit value as a decimal string and return a pointer past its terminator
+static char ICACHE_FLASH_ATTR *format_int(char *p, uint32_t value, int isSigned)
+{
+    char digits[10];
+    int n = 0;
+    
+    if (isSigned && (int32_t)value < 0) {
+        *p++ = '-';
+        value = 0 - value;
+    }
+    do {
+        digits[n++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    while (n > 0)
+        *p++ = digits[--n];
+    *p++ = '\0';
+    
+    return p;
+}
+
+// decode the arguments of a frame into sscp_args and find its handler
+// buf contains the length bytes, the frame body and the CRC if there is one
+static int ICACHE_FLASH_ATTR parse_frame(uint8_t *buf, cmd_def **pDef, int *pArgc, char *argv[])
+{
+    char *next = sscp_args;
+    char *end = &sscp_args[sizeof(sscp_args)];
+    uint8_t *p, *bodyEnd;
+    cmd_def *def;
+    int length, argc;
+    
+    length = buf[0] | (buf[1] << 8);
+    bodyEnd = &buf[2 + length];
+    
+    if (buf[2] & SSCP_FRAME_CRC) {
+        unsigned short crc = bodyEnd[0] | (bodyEnd[1] << 8);
+        if (crc16_data(buf, 2 + length, 0) != crc) {
+            sscp_log("SSCP: frame CRC mismatch");
+            return SSCP_ERROR_INVALID_CRC;
+        }
+    }
+    
+    p = &buf[3];
+    argc = 0;
+    
+    if (*p < SSCP_MIN_TOKEN || !(def = token_cmds[*p - SSCP_MIN_TOKEN])) {
+        os_printf("No handler for opcode %02x\n", *p);
+        return SSCP_ERROR_INVALID_REQUEST;
+    }
+    argv[argc++] = def->cmd;
+    ++p;
+    
+    while (p < bodyEnd) {
+        char *arg = next;
+        uint32_t value;
+        int type = *p++;
+        int count;
+        
+        switch (type) {
+        case SSCP_TKN_INT8:
+        case SSCP_TKN_UINT8:
+            count = 1;
+            break;
+        case SSCP_TKN_INT16:
+        case SSCP_TKN_UINT16:
+            count = 2;
+            break;
+        case SSCP_TKN_INT32:
+        case SSCP_TKN_UINT32:
+            count = 4;
+            break;
+        case SSCP_TKN_STRING:
+            count = (p < bodyEnd ? *p++ : 0);
+            break;
+        default:
+            count = 0;
+            break;
+        }
+        
+        // make sure the argument fits in both the frame and the argument buffer
+        if (p + count > bodyEnd || end - next < count + 12)
+            return SSCP_ERROR_INVALID_SIZE;
+        
+        switch (type) {
+        case SSCP_TKN_INT8:
+            next = format_int(next, (int8_t)p[0], 1);
+            break;
+        case SSCP_TKN_UINT8:
+            next = format_int(next, p[0], 0);
+            break;
+        case SSCP_TKN_INT16:
+            next = format_int(next, (int16_t)(p[0] | (p[1] << 8)), 1);
+            break;
+        case SSCP_TKN_UINT16:
+            next = format_int(next, p[0] | (p[1] << 8), 0);
+            break;
+        case SSCP_TKN_INT32:
+        case SSCP_TKN_UINT32:
+            value = p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+            next = format_int(next, value, type == SSCP_TKN_INT32);
+            break;
+        case SSCP_TKN_STRING:
+            os_memcpy(next, p, count);
+            next += count;
+            *next++ = '\0';
+            break;
+        default:
+            {
+                char *name = token_name(type, NULL);
+                if (!name)
+                    return SSCP_ERROR_INVALID_ARGUMENT;
+                os_strcpy(next, name);
+                next += os_strlen(name) + 1;
+            }
+            break;
+        }
+        p += count;
+        
+        if (argc < SSCP_MAX_ARGS)
+            argv[argc++] = arg;
+    }
+    
+    argv[argc] = NULL;
+    
+    *pDef = def;
+    *pArgc = argc;
+    return 0;
+}
+
+static void ICACHE_FLASH_ATTR sscp_processFrame(uint8_t *buf, int len)
+{
+    char *argv[SSCP_MAX_ARGS + 1];
+    cmd_def *def;
+    int argc, error;
+    
+#ifdef DUMP_CMDS
+    dump("frame", buf, len);
 #endif
+    
+    sscp_frame_flags = buf[2];
+    sscp_frame_mode = 1;
+    
+    if ((error = parse_frame(buf, &def, &argc, argv)) != 0) {
+        sscp_sendResponse("E,%d", error);
+        return;
+    }
+    
+    sscp_dispatch_command(def, argc, argv);
+}
 
-    sscp_processing = 1;
-    sscp_log("Calling '%s' handler", def->cmd);
-    (*def->handler)(argc, argv);
+// this is called when the payload of a queued command has been received
+static void ICACHE_FLASH_ATTR stage_cb(void *data, int count)
+{
+    sscp_queued_command *entry = (sscp_queued_command *)data;
+    sscp_stage_length = count;
+    entry->payload = PAYLOAD_STAGED;
+    post_usr_task(sscp_queue_task, 0);
+}
+
+// find the payload size of a command by parsing a scratch copy of it
+static int ICACHE_FLASH_ATTR payload_size(cmd_def *command, int frame, uint8_t *buf)
+{
+    char *argv[SSCP_MAX_ARGS + 1];
+    cmd_def *def;
+    int argc, size;
+    
+    if (frame) {
+        if (parse_frame(buf, &def, &argc, argv) != 0)
+            return 0;
+    }
+    else {
+        if (parse_command(command, (char *)buf, &def, &argc, argv) != 0)
+            return 0;
+    }
+    
+    if (def->payloadArgc == 0 || argc < def->payloadArgc)
+        return 0;
+        
+    size = atoi(argv[argc - 1]);
+    return size > 0 ? size : 0;
+}
+
+// reply to a command that could not be queued without disturbing the running command
+static void ICACHE_FLASH_ATTR reject_command(int frame, int flags, int seq)
+{
+    int processing = sscp_processing;
+    int frameMode = sscp_frame_mode;
+    int frameFlags = sscp_frame_flags;
+    int currentSeq = sscp_current_seq;
+    
+    sscp_frame_mode = frame;
+    sscp_frame_flags = flags;
+    sscp_current_seq = seq;
+    sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+    
+    sscp_processing = processing;
+    sscp_frame_mode = frameMode;
+    sscp_frame_flags = frameFlags;
+    sscp_current_seq = currentSeq;
+}
+
+// add a command that arrived while another was being processed to the queue
+// buf is sscp_buffer and is overwritten while looking for a payload size
+static void ICACHE_FLASH_ATTR sscp_queueCommand(cmd_def *command, int frame, uint8_t *buf, int len)
+{
+    sscp_queued_command *entry;
+    int seq = sscp_seq++ & 0xff;
+    int size;
+    
+    if (sscp_queue_count >= SSCP_QUEUE_MAX) {
+        sscp_log("SSCP: command queue full");
+        if ((size = payload_size(command, frame, buf)) > 0)
+            sscp_capturePayload(NULL, size, NULL, NULL);
+        reject_command(frame, frame ? buf[2] : 0, seq);
+        return;
+    }
+    
+    entry = &sscp_queue[(sscp_queue_head + sscp_queue_count++) % SSCP_QUEUE_MAX];
+    entry->command = command;
+    entry->frame = frame;
+    entry->seq = seq;
+    entry->length = len;
+    os_memcpy(entry->buffer, buf, len + 1); // include the terminator of text commands
+    entry->payload = PAYLOAD_NONE;
+    
+    if ((size = payload_size(command, frame, buf)) > 0) {
+    
+        // only one payload can be staged at a time
+        if (size > sizeof(sscp_stage) || sscp_stage_busy) {
+            sscp_capturePayload(NULL, size, NULL, NULL);
+            entry->payload = PAYLOAD_DROPPED;
+        }
+        else {
+            sscp_capturePayload(sscp_stage, size, stage_cb, entry);
+            entry->payload = PAYLOAD_PENDING;
+            sscp_stage_busy = 1;
+        }
+    }
+    
+    sscp_log("SSCP: queued command %d", seq);
+    
+    // a WAIT would hold up this command so end it now
+    cmds_cancel_wait(1);
+}
+
+// run the command at the head of the queue once the previous one has replied
+static void ICACHE_FLASH_ATTR sscp_queue_handler(os_event_t *event)
+{
+    sscp_queued_command *entry;
+    
+    if (sscp_processing || sscp_queue_count == 0)
+        return;
+        
+    entry = &sscp_queue[sscp_queue_head];
+    if (entry->payload == PAYLOAD_PENDING)
+        return;
+        
+    sscp_queue_head = (sscp_queue_head + 1) % SSCP_QUEUE_MAX;
+    --sscp_queue_count;
+    
+    sscp_current_seq = entry->seq;
+    
+    if (entry->payload == PAYLOAD_DROPPED) {
+        sscp_frame_mode = entry->frame;
+        sscp_frame_flags = entry->frame ? entry->buffer[2] : 0;
+        sscp_sendResponse("E,%d", SSCP_ERROR_BUSY);
+        return;
+    }
+    
+    sscp_stage_ready = (entry->payload == PAYLOAD_STAGED);
+    
+    if (entry->frame)
+        sscp_processFrame(entry->buffer, entry->length);
+    else
+        sscp_process(entry->command, (char *)entry->buffer, entry->length);
+        
+    // release the staged payload if the handler failed before asking for it
+    if (entry->payload == PAYLOAD_STAGED) {
+        sscp_stage_ready = 0;
+        sscp_stage_busy = 0;
+    }
 }
 
 void ICACHE_FLASH_ATTR sscp_filter(char *buf, short len, void (*outOfBand)(void *data, char *buf, short len), void *data)
@@ -412,7 +1628,7 @@ void ICACHE_FLASH_ATTR sscp_filter(char *buf, short len, void (*outOfBand)(void
         switch (sscp_state) {
         case STATE_IDLE:
             if (*p == flashConfig.sscp_start) {
-                if (sscp_processing) {
+                if (sscp_processing && !flashConfig.sscp_pipeline) {
                     sscp_log("SSCP: busy processing a command");
                     ++p;
                     continue;
@@ -427,6 +1643,7 @@ void ICACHE_FLASH_ATTR sscp_filter(char *buf, short len, void (*outOfBand)(void
                 sscp_state = STATE_PARSING;
                 sscp_separator = -1;
                 sscp_length = 0;
+                sscp_command = NULL;
                 ++p;
             }
             else {
@@ -450,8 +1667,24 @@ void ICACHE_FLASH_ATTR sscp_filter(char *buf, short len, void (*outOfBand)(void
             case '\r':
                 sscp_buffer[sscp_length] = '\0';
                 sscp_state = STATE_IDLE; // could be changed to STATE_COLLECTING by handler
-                sscp_process((char *)sscp_buffer, sscp_length);
                 start = ++p;
+                if (sscp_processing || sscp_queue_count > 0)
+                    sscp_queueCommand(sscp_command, 0, sscp_buffer, sscp_length);
+                else {
+                    sscp_current_seq = sscp_seq++ & 0xff;
+                    sscp_process(sscp_command, (char *)sscp_buffer, sscp_length);
+                }
+                break;
+            case SSCP_TKN_FRAME:
+                if (sscp_length == 0) {
+                    sscp_state = STATE_FRAME_LENGTH;
+                    ++p;
+                }
+                else {
+                    os_printf("SSCP: unexpected frame token\n");
+                    sscp_state = STATE_IDLE;
+                    start = ++p;
+                }
                 break;
             case SSCP_TKN_INT8:
             case SSCP_TKN_UINT8:
@@ -471,74 +1704,27 @@ void ICACHE_FLASH_ATTR sscp_filter(char *buf, short len, void (*outOfBand)(void
                 sscp_state = STATE_COLLECTING;
                 sscp_collect = 4;
                 break;
-            case SSCP_TKN_JOIN:
-            case SSCP_TKN_CHECK:
-            case SSCP_TKN_SET:
-            case SSCP_TKN_POLL:
-            case SSCP_TKN_PATH:
-            case SSCP_TKN_SEND:
-            case SSCP_TKN_RECV:
-            case SSCP_TKN_CLOSE:
-            case SSCP_TKN_RESTART:
-            case SSCP_TKN_SLEEP:
-            case SSCP_TKN_LOCK:
-            case SSCP_TKN_LISTEN:
-            case SSCP_TKN_ARG:
-            case SSCP_TKN_REPLY:
-            case SSCP_TKN_CONNECT:
-            case SSCP_TKN_UDP:
-            case SSCP_TKN_APSCAN:
-            case SSCP_TKN_APGET:
-            case SSCP_TKN_CREGET:
-            case SSCP_TKN_HTTP:
-            case SSCP_TKN_WS:
-            case SSCP_TKN_TCP:
-            case SSCP_TKN_STA:
-            case SSCP_TKN_AP:
-            case SSCP_TKN_STA_AP:
-            case SSCP_TKN_SAVECFG:
-            case SSCP_TKN_DEFACFG:
+            default:
                 {
                     int length, sep;
                     char *name;
-                    switch (*p++) {
-                    case SSCP_TKN_JOIN:     name = "JOIN";    sep = ':'; break;
-                    case SSCP_TKN_CHECK:    name = "CHECK";   sep = ':'; break;
-                    case SSCP_TKN_SET:      name = "SET";     sep = ':'; break;
-                    case SSCP_TKN_POLL:     name = "POLL";    sep = ':'; break;
-                    case SSCP_TKN_PATH:     name = "PATH";    sep = ':'; break;
-                    case SSCP_TKN_SEND:     name = "SEND";    sep = ':'; break;
-                    case SSCP_TKN_RECV:     name = "RECV";    sep = ':'; break;
-                    case SSCP_TKN_CLOSE:    name = "CLOSE";   sep = ':'; break;
-                    case SSCP_TKN_RESTART:  name = "RESTART"; sep = ':'; break;
-                    case SSCP_TKN_SLEEP:    name = "SLEEP";   sep = ':'; break;
-                    case SSCP_TKN_LOCK:     name = "LOCK";    sep = ':'; break;
-                    case SSCP_TKN_LISTEN:   name = "LISTEN";  sep = ':'; break;
-                    case SSCP_TKN_ARG:      name = "ARG";     sep = ':'; break;
-                    case SSCP_TKN_REPLY:    name = "REPLY";   sep = ':'; break;
-                    case SSCP_TKN_CONNECT:  name = "CONNECT"; sep = ':'; break;
-                    case SSCP_TKN_UDP:      name = "UDP";     sep = ':'; break;
-                    case SSCP_TKN_APSCAN:   name = "APSCAN";  sep = ':'; break;
-                    case SSCP_TKN_APGET:    name = "APGET";   sep = ':'; break;
-                    case SSCP_TKN_CREGET:   name = "CREGET";  sep = ':'; break;
-                    case SSCP_TKN_FINFO:    name = "FINFO";   sep = ':'; break;
-                    case SSCP_TKN_FCOUNT:   name = "FCOUNT";  sep = ':'; break;
-                    case SSCP_TKN_FRUN:     name = "FRUN";    sep = ':'; break;
-                    case SSCP_TKN_HTTP:     name = "HTTP";    sep = ','; break;
-                    case SSCP_TKN_WS:       name = "WS";      sep = ','; break;
-                    case SSCP_TKN_TCP:      name = "TCP";     sep = ','; break;
-                    case SSCP_TKN_STA:      name = "STA";     sep = ','; break;
-                    case SSCP_TKN_AP:       name = "AP";      sep = ','; break;
-                    case SSCP_TKN_STA_AP:   name = "STA+AP";  sep = ','; break;
-                    case SSCP_TKN_SAVECFG:  name = "SAVECFG"; sep = ':'; break;
-                    case SSCP_TKN_DEFACFG:  name = "DEFACFG"; sep = ':'; break;
-                                                            
-                    default:
-                        // internal error
-                        name = "";
-                        sep = -1;
+                    if (!(name = token_name(*p, &sep))) {
+                        if (sscp_length < SSCP_BUFFER_MAX)
+                            sscp_buffer[sscp_length++] = *p++;
+                        else {
+                            os_printf("SSCP: command too long\n");
+                            sscp_state = STATE_IDLE;
+                            start = p++;
+                        }
                         break;
                     }
+                    // a leading command token selects the handler directly
+                    if (sscp_length == 0 && !sscp_command && (sscp_command = token_cmds[*p - SSCP_MIN_TOKEN]) != NULL) {
+                        ++p;
+                        break;
+                    }
+                    // otherwise the token is spelled out
+                    ++p;
                     length = os_strlen(name);
                     if (sscp_length + length < SSCP_BUFFER_MAX) {
                         os_strcpy((char *)&sscp_buffer[sscp_length], name);
@@ -552,15 +1738,6 @@ void ICACHE_FLASH_ATTR sscp_filter(char *buf, short len, void (*outOfBand)(void
                     }
                 }
                 break;
-            default:
-                if (sscp_length < SSCP_BUFFER_MAX)
-                    sscp_buffer[sscp_length++] = *p++;
-                else {
-                    os_printf("SSCP: command too long\n");
-                    sscp_state = STATE_IDLE;
-                    start = p++;
-                }
-                break;
             }
             break;
         case STATE_COLLECTING:
@@ -633,11 +1810,42 @@ void ICACHE_FLASH_ATTR sscp_filter(char *buf, short len, void (*outOfBand)(void
                 sscp_separator = ',';
             }
             break;
+        case STATE_FRAME_LENGTH:
+            sscp_buffer[sscp_length++] = *p++;
+            if (sscp_length == 2) {
+                sscp_frame_remaining = sscp_buffer[0] | (sscp_buffer[1] << 8);
+                if (sscp_frame_remaining < 2 || sscp_frame_remaining > SSCP_BUFFER_MAX) {
+                    os_printf("SSCP: bad frame length %d\n", sscp_frame_remaining);
+                    sscp_state = STATE_IDLE;
+                    start = p;
+                }
+                else
+                    sscp_state = STATE_FRAME;
+            }
+            break;
+        case STATE_FRAME:
+            sscp_buffer[sscp_length++] = *p++;
+            if (sscp_length == 3 && (sscp_buffer[2] & SSCP_FRAME_CRC))
+                sscp_frame_remaining += 2;
+            if (--sscp_frame_remaining == 0) {
+                sscp_state = STATE_IDLE; // could be changed to STATE_PAYLOAD by handler
+                start = p;
+                if (sscp_processing || sscp_queue_count > 0)
+                    sscp_queueCommand(NULL, 1, sscp_buffer, sscp_length);
+                else {
+                    sscp_current_seq = sscp_seq++ & 0xff;
+                    sscp_processFrame(sscp_buffer, sscp_length);
+                }
+            }
+            break;
         case STATE_PAYLOAD:
-            *sscp_payload++ = *p++;
+            if (sscp_payload)
+                *sscp_payload++ = *p;
+            ++p;
             if (--sscp_payload_remaining == 0) {
-                (*sscp_payload_cb)(sscp_payload_data, sscp_payload_length);
                 sscp_state = STATE_IDLE;
+                if (sscp_payload_cb)
+                    (*sscp_payload_cb)(sscp_payload_data, sscp_payload_length);
             }
             start = p;
             break;
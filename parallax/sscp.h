@@ -12,14 +12,23 @@
 #include "httpd.h"
 #include "cgiwebsocket.h"
 
-#define SSCP_LISTENER_MAX   4
+#define SSCP_LISTENER_MAX   12
 #define SSCP_PATH_MAX       32
 
-#define SSCP_CONNECTION_MAX 4
+#define SSCP_CONNECTION_MAX 4   // number of connections when cmd-connections is zero
+#define SSCP_CONNECTION_LIMIT 16 // the most cmd-connections can ask for
 #define SSCP_RX_BUFFER_MAX  1024 // 4096 was OK from tablet/smartphone, but not from desktop Chrome
 #define SSCP_TX_BUFFER_MAX  1024
 
-#define SSCP_HANDLE_MAX     (SSCP_LISTENER_MAX + SSCP_CONNECTION_MAX)
+#define SSCP_HANDLE_MAX     (SSCP_LISTENER_MAX + SSCP_CONNECTION_LIMIT)
+
+// handles are bits in the POLL and WAIT masks, which are parsed with atoi
+#if SSCP_HANDLE_MAX > 30
+#error "too many SSCP handles for a 31 bit event mask"
+#endif
+
+// pseudo handle used to post events that don't belong to a connection
+#define SSCP_EVENT_WIFI     0
 
 enum {
     SSCP_TKN_START              = 0xFE,
@@ -60,7 +69,13 @@ enum {
     SSCP_TKN_FRUN               = 0xDF,
     SSCP_TKN_UDP                = 0xDE,
     SSCP_TKN_LOCK               = 0xDD,
+    SSCP_TKN_FRAME              = 0xDC,
+    SSCP_TKN_STRING             = 0xDB,
     SSCP_TKN_CREGET             = 0xDA,
+    SSCP_TKN_WAIT               = 0xD9,
+    SSCP_TKN_TCPOPT             = 0xD8,
+    SSCP_TKN_SENDTO             = 0xD7,
+    SSCP_TKN_RECVFROM           = 0xD6,
     SSCP_TKN_SAVECFG            = 0xCF,
     SSCP_TKN_DEFACFG            = 0xCD,   
     SSCP_MIN_TOKEN              = 0x80
@@ -69,6 +84,8 @@ enum {
 typedef struct sscp_hdr sscp_hdr;
 typedef struct sscp_listener sscp_listener;
 typedef struct sscp_connection sscp_connection;
+typedef struct sscp_chunk sscp_chunk;
+typedef struct sscp_datagram sscp_datagram;
 
 enum {
     SSCP_ERROR_INVALID_REQUEST      = 1,
@@ -85,7 +102,15 @@ enum {
     SSCP_ERROR_UNIMPLEMENTED        = 12,
     SSCP_ERROR_BUSY                 = 13,
     SSCP_ERROR_INTERNAL_ERROR       = 14,
-    SSCP_ERROR_INVALID_METHOD       = 15
+    SSCP_ERROR_INVALID_METHOD       = 15,
+    SSCP_ERROR_INVALID_CRC          = 16,
+    SSCP_ERROR_TIMEOUT              = 17
+};
+
+// binary frame flags
+enum {
+    SSCP_FRAME_CRC                  = 0x01, // frame is followed by a CRC16 of the length, flags and body
+    SSCP_FRAME_SEQ                  = 0x02  // reply flags are followed by the sequence number of the command
 };
 
 enum {
@@ -116,6 +141,13 @@ struct sscp_hdr {
 struct sscp_listener {
     sscp_hdr hdr;
     char path[SSCP_PATH_MAX];
+    int prefixLength;       // length of the path before a trailing '*', -1 if there is none
+    uint32_t hash;          // hash of the path or prefix
+    sscp_listener *next;    // next listener in the same hash bucket
+    struct {
+        struct espconn conn;
+        esp_tcp tcp;
+    } tcp;
 };
 
 enum {
@@ -123,12 +155,12 @@ enum {
     CONNECTION_INIT         = 0x00000001,   // set when a new request has been received ('G', 'P', 'T', 'W')
     CONNECTION_TERM         = 0x00000002,   // set when the remote end has closed a connection ('X')
     CONNECTION_FAIL         = 0x00000004,   // set when the connection has failed ('E')
-    CONNECTION_TXFULL       = 0x00000004,   // set when outgoing data buffer is full ('D')
     CONNECTION_TXDONE       = 0x00000008,   // set when an outgoing transfer is complete ('S')
 
     // internal state bits
     CONNECTION_RXFULL       = 0x00010000,   // set when incoming data is available
-    CONNECTION_TXFREE       = 0x00020000    // set when the connection should be freed after TXDONE is delivered
+    CONNECTION_TXFREE       = 0x00020000,   // set when the connection should be freed after TXDONE is delivered
+    CONNECTION_TXFULL       = 0x00040000    // set when outgoing data buffer is full
 };
 
 enum {
@@ -153,25 +185,50 @@ struct sscp_connection {
         } ws;
         struct {
             int state;
+            struct espconn *pConn;  // &conn, or the espconn of an accepted connection
             struct espconn conn;
             esp_tcp tcp;
+            sscp_chunk *rxQueue;    // received data that didn't fit in rxBuffer
+            int rxQueued;           // number of bytes in rxQueue
+            int rxHeld;             // receiving is on hold until RECV catches up
+            sscp_chunk *txQueue;    // SEND payloads espconn hasn't taken yet
+            int txQueued;           // number of bytes in txQueue
+            int txReuse;            // ESPCONN_COPY is off, espconn sends straight from txQueue
+            int txInFlight;         // the head of txQueue is with espconn (txReuse only)
         } tcp;
         struct {
             int state;
             struct espconn conn;
             esp_udp udp;
+            int unconnected;        // bound by LISTEN, every datagram is addressed by SENDTO
+            uint8 remoteIp[4];      // CONNECT destination, espconn overwrites its copy on receive
+            int remotePort;
+            uint8 txRemoteIp[4];    // destination of the datagram in txBuffer
+            int txRemotePort;
+            uint8 rxRemoteIp[4];    // sender of the datagram in rxBuffer
+            int rxRemotePort;
+            sscp_datagram *rxQueue; // datagrams that arrived while rxBuffer was full
+            int rxQueued;           // number of datagrams in rxQueue
+            int rxDropped;          // datagrams lost because rxQueue was full
         } udp;
     } d;
-    char rxBuffer[SSCP_RX_BUFFER_MAX];
+    char *rxBuffer;         // rxBuffer and txBuffer come from the buffer pool
+    int rxSize;
     int rxCount;
     int rxIndex;
-    char txBuffer[SSCP_TX_BUFFER_MAX];
+    char *txBuffer;
+    int txSize;
     int txCount;
     int txIndex;
+    int poolIndex;          // first pool unit of the buffers
+    int poolUnits;
+    uint32_t lastActive;    // system_get_time of the last command or network event
 };
 
 extern sscp_listener sscp_listeners[];
-extern sscp_connection sscp_connections[];
+extern sscp_connection *sscp_connections;
+extern int sscp_connection_count;
+extern uint32_t sscp_reaped_count;
 
 void sscp_init(void);
 void sscp_reset(void);
@@ -185,10 +242,18 @@ void sscp_close_listener(sscp_listener *listener);
 sscp_connection *sscp_get_connection(int i);
 sscp_connection *sscp_allocate_connection(int type, sscp_dispatch *dispatch);
 void sscp_close_connection(sscp_connection *connection);
+void sscp_free_connection(sscp_connection *connection);
+int sscp_pool_free(void);
 void sscp_sendResponse(char *fmt, ...);
 void sscp_sendEvent(char *fmt, ...);
 void sscp_send(int prefix, char *fmt, ...);
 void sscp_sendPayload(char *buf, int cnt);
+void sscp_postEvent(int handle);
+int sscp_checkForEvents(uint32_t mask);
+void sscp_initEventPin(void);
+int sscp_beginBatch(int max);
+int sscp_batchFull(void);
+int sscp_endBatch(void);
 void sscp_log(char *fmt, ...);
 
 // from sscp-cmds.c
@@ -196,6 +261,9 @@ void cmds_do_nothing(int argc, char *argv[]);
 void cmds_do_listen(int argc, char *argv[]);
 void cmds_do_join(int argc, char *argv[]);
 void cmds_do_poll(int argc, char *argv[]);
+void cmds_do_wait(int argc, char *argv[]);
+void cmds_wake_wait(void);
+void cmds_cancel_wait(int reply);
 void cmds_do_path(int argc, char *argv[]);
 void cmds_do_send(int argc, char *argv[]);
 void cmds_do_recv(int argc, char *argv[]);
@@ -233,9 +301,18 @@ void sscp_websocketConnect(Websock *ws);
 
 // from sscp-tcp.c
 void tcp_do_connect(int argc, char *argv[]);
+void tcp_do_listen(int argc, char *argv[]);
+void tcp_do_opt(int argc, char *argv[]);
 
 // from sscp-udp.c
 void udp_do_connect(int argc, char *argv[]);
+void udp_do_listen(int argc, char *argv[]);
+void udp_do_sendto(int argc, char *argv[]);
+void udp_do_recvfrom(int argc, char *argv[]);
+
+// from sscp-dns.c
+sint8 sscp_gethostbyname(struct espconn *conn, const char *name, ip_addr_t *ipaddr, dns_found_callback cb);
+void sscp_dns_store(const char *name, ip_addr_t *ipaddr);
 
 // from sscp-wifi.c
 void wifi_do_apscan(int argc, char *argv[]);
@@ -68,11 +68,6 @@ int sscpRequestPayload(wifi *dev, const char *buf, int len)
     return SendSerialData(dev->port, buf, len);
 }
 
-int sscpCollectPayload(wifi *dev, char *buf, int count)
-{
-    return ReceiveSerialData(dev->port, buf, count);
-}
-
 static int rxCheck(wifi *dev)
 {
     if (dev->inputNext >= dev->inputCount) {
@@ -85,6 +80,93 @@ static int rxCheck(wifi *dev)
     return dev->inputBuffer[dev->inputNext++];
 }
 
+static int rxWait(wifi *dev)
+{
+    int ch;
+    while ((ch = rxCheck(dev)) == -1)
+        ;
+    return ch;
+}
+
+// the payload may already be partly in the input buffer behind the response
+int sscpCollectPayload(wifi *dev, char *buf, int count)
+{
+    int i;
+    for (i = 0; i < count; ++i)
+        buf[i] = rxWait(dev);
+    return count;
+}
+
+// send a binary frame with 32 bit integer arguments
+int sscpFrameRequest(wifi *dev, int opcode, const int32_t *args, int argc)
+{
+    uint8_t buf[100];
+    int len = 0, i;
+    buf[len++] = CMD_START_BYTE;
+    buf[len++] = CMD_FRAME_BYTE;
+    len += 2; // length is filled in below
+    buf[len++] = 0; // flags
+    buf[len++] = opcode;
+    for (i = 0; i < argc && len + 5 <= sizeof(buf); ++i) {
+        buf[len++] = CMD_INT32_BYTE;
+        buf[len++] = args[i];
+        buf[len++] = args[i] >> 8;
+        buf[len++] = args[i] >> 16;
+        buf[len++] = args[i] >> 24;
+    }
+    buf[2] = len - 4;
+    buf[3] = (len - 4) >> 8;
+    return SendSerialData(dev->port, buf, len);
+}
+
+// receive a binary reply frame and convert it to the text form of the response
+int sscpGetFrameResponse(wifi *dev, char *buf, int maxSize)
+{
+    uint8_t frame[256];
+    int length, i, j;
+
+    for (;;) {
+        if (rxWait(dev) != CMD_START_BYTE || rxWait(dev) != CMD_FRAME_BYTE)
+            continue;
+        length = rxWait(dev);
+        length |= rxWait(dev) << 8;
+        if (length < 3 || length > sizeof(frame))
+            return -1;
+        for (i = 0; i < length; ++i)
+            frame[i] = rxWait(dev);
+        if (frame[0] & CMD_FRAME_CRC) {
+            rxWait(dev);
+            rxWait(dev);
+        }
+        i = (frame[0] & CMD_FRAME_SEQ) ? 2 : 1;
+        if (frame[i] == '=')
+            break;
+        dbg("MSG: skipping event frame\n");
+    }
+
+    j = 0;
+    buf[j++] = frame[i++];
+    buf[j++] = frame[i++];
+    while (i < length && j < maxSize) {
+        if (frame[i] == CMD_INT32_BYTE && i + 5 <= length) {
+            int32_t value = frame[i + 1] | (frame[i + 2] << 8) | (frame[i + 3] << 16) | ((uint32_t)frame[i + 4] << 24);
+            j += snprintf(&buf[j], maxSize - j, ",%d", value);
+            i += 5;
+        }
+        else if (frame[i] == CMD_STRING_BYTE && i + 2 <= length && i + 2 + frame[i + 1] <= length) {
+            j += snprintf(&buf[j], maxSize - j, ",%.*s", frame[i + 1], &frame[i + 2]);
+            i += 2 + frame[i + 1];
+        }
+        else
+            return -1;
+    }
+    if (j >= maxSize)
+        return -1;
+    buf[j] = '\0';
+
+    return j;
+}
+
 static int checkForMessage(wifi *dev, int type, char *buf, int maxSize)
 {
     int ch, newTail, i, j;
@@ -35,6 +35,16 @@
 #define CMD_ARG             "\xE6"
 #define CMD_REPLY           "\xE5"
 #define CMD_CONNECT         "\xE4"
+#define CMD_RECVFROM        "\xD6"
+
+#define CMD_FRAME_BYTE      0xDC
+#define CMD_STRING_BYTE     0xDB
+#define CMD_INT32_BYTE      0xF9
+#define CMD_RECV_BYTE       0xE9
+#define CMD_RECVFROM_BYTE   0xD6
+
+#define CMD_FRAME_CRC       0x01
+#define CMD_FRAME_SEQ       0x02
 
 #define CMD_END             "\r"
 
@@ -68,6 +78,8 @@ int sscpClose(wifi *dev);
 int sscpRequest(wifi *dev, const char *fmt, ...);
 int sscpRequestV(wifi *dev, const char *fmt, va_list ap);
 int sscpRequestPayload(wifi *dev, const char *buf, int len);
+int sscpFrameRequest(wifi *dev, int opcode, const int32_t *args, int argc);
+int sscpGetFrameResponse(wifi *dev, char *buf, int maxSize);
 int sscpCollectPayload(wifi *dev, char *buf, int count);
 int sscpGetResponse(wifi *dev, char *buf, int maxSize);
 int sscpCheckForEvent(wifi *dev, char *buf, int maxSize);
@@ -133,6 +133,61 @@ void checkSerialResponse(TestState *state, const char *fmt, ...)
         failTest(state, ": '%s'", response);
 }
 
+int frameRequest(TestState *state, int opcode, int argc, ...)
+{
+    int32_t args[CMD_MAX_ARGS];
+    va_list ap;
+    int ret, i;
+
+    va_start(ap, argc);
+    for (i = 0; i < argc && i < CMD_MAX_ARGS; ++i)
+        args[i] = va_arg(ap, int);
+    va_end(ap);
+
+    ret = sscpFrameRequest(state->dev, opcode, args, i);
+
+    if (ret < 0)
+        failTest(state, ": sending frame");
+
+    return ret >= 0;
+}
+
+void checkFrameResponse(TestState *state, const char *fmt, ...)
+{
+    char response[1024];
+    va_list ap;
+    int ret;
+
+    if (sscpGetFrameResponse(state->dev, response, sizeof(response)) < 0) {
+        failTest(state, ": receiving frame");
+        return;
+    }
+
+    va_start(ap, fmt);
+    ret = parseBufferV(response, fmt, ap);
+    va_end(ap);
+
+    if (ret >= 0)
+        passTest(state, "");
+    else
+        failTest(state, ": '%s'", response);
+}
+
+void checkPayload(TestState *state, const char *expected, int count)
+{
+    char payload[1024];
+
+    if (count > sizeof(payload) || sscpCollectPayload(state->dev, payload, count) != count) {
+        failTest(state, ": receiving payload");
+        return;
+    }
+
+    if (memcmp(payload, expected, count) == 0)
+        passTest(state, "");
+    else
+        failTest(state, ": got '%.*s'", count, payload);
+}
+
 int waitAndCheckSerialResponse(TestState *state, const char *idle, const char *fmt, ...)
 {
     char response[1024];
@@ -36,6 +36,9 @@ void testResults(TestState *state);
 int serialRequest(TestState *state, const char *fmt, ...);
 void checkSerialResponse(TestState *state, const char *fmt, ...);
 int waitAndCheckSerialResponse(TestState *state, const char *idle, const char *fmt, ...);
+int frameRequest(TestState *state, int opcode, int argc, ...);
+void checkFrameResponse(TestState *state, const char *fmt, ...);
+void checkPayload(TestState *state, const char *expected, int count);
 
 /* http requests */
 int sendRequest(SOCKADDR_IN *addr, const char *method, const char *url, const char *body);
@@ -1,3 +1,4 @@
+#include <stdio.h>
 #include "tests.h"
 
 #define DO_BLINK_TEST
@@ -7,6 +8,9 @@ static int test_blink(TestState *state);
 #endif
 
 static int test_001(TestState *state);
+static int test_udp_frames(TestState *state);
+
+#define UDP_TEST_PORT   5555
 
 void run_tests(TestState *parent, int selectedTest)
 {
@@ -25,6 +29,39 @@ void run_tests(TestState *parent, int selectedTest)
             checkSerialResponse(&state, "=E,1");
     }
 
+    if (startTest(&state, "POLL with a batch count and no events")) {
+        if (serialRequest(&state, "POLL:0,4"))
+            checkSerialResponse(&state, "=N,0,0");
+    }
+
+    if (startTest(&state, "WAIT times out with no events")) {
+        if (serialRequest(&state, "WAIT:100,0"))
+            checkSerialResponse(&state, "=N,0,0");
+    }
+
+    if (startTest(&state, "tagged replies with cmd-pipeline")) {
+        int seq1, seq2;
+        if (serialRequest(&state, "SET:cmd-pipeline,1"))
+            checkSerialResponse(&state, "=^i:S,0", &seq1);
+        if (state.testPassed && serialRequest(&state, "")) {
+            checkSerialResponse(&state, "=^i:S,0", &seq2);
+            if (state.testPassed && seq2 != ((seq1 + 1) & 0xff))
+                failTest(&state, "expected sequence %d, got %d", (seq1 + 1) & 0xff, seq2);
+        }
+        if (serialRequest(&state, "SET:cmd-pipeline,0"))
+            checkSerialResponse(&state, "=S,0");
+    }
+
+    if (startTest(&state, "LISTEN on a TCP port")) {
+        int listener;
+        if (serialRequest(&state, "LISTEN:TCP,8080"))
+            checkSerialResponse(&state, "=S,^i", &listener);
+        if (state.testPassed && serialRequest(&state, "PATH:%d", listener))
+            checkSerialResponse(&state, "=S,8080");
+        if (state.testPassed && serialRequest(&state, "CLOSE:%d", listener))
+            checkSerialResponse(&state, "=S,0");
+    }
+
 #ifdef DO_BLINK_TEST
     if (startTest(&state, "Blink LEDs on GPIO13 and GPIO15")) {
         if (test_blink(&state))
@@ -69,6 +106,13 @@ void run_tests(TestState *parent, int selectedTest)
             failTest(&state, "");
     }
 
+    if (state.ssid && startTest(&state, "UDP RECV and RECVFROM in frame mode")) {
+        if (test_udp_frames(&state))
+            passTest(&state, "");
+        else
+            failTest(&state, "");
+    }
+
     testResults(&state);
 }
 
@@ -200,3 +244,77 @@ static int test_001(TestState *state)
     return state2.testPassed;
 }
 
+static int test_udp_frames(TestState *state)
+{
+    TestState state2;
+    SOCKADDR_IN addr;
+    SOCKET sock = INVALID_SOCKET;
+    int handle, count, port, a, b, c, d;
+    char ipaddr[32];
+
+    initState(&state2, "  Subtest", state);
+
+    if (startTest(&state2, "LISTEN on a UDP port")) {
+        if (serialRequest(&state2, "LISTEN:UDP,%d", UDP_TEST_PORT))
+            checkSerialResponse(&state2, "=S,^i", &handle);
+    }
+
+    beginGroup(&state2);
+
+    if (startTest(&state2, "Send datagrams to WX module")) {
+        if (!skipTest(&state2)) {
+            addr = state->moduleAddr;
+            addr.sin_port = htons(UDP_TEST_PORT);
+            if (BindSocket(0, &sock) == 0
+            &&  SendSocketDataTo(sock, "hello", 5, &addr) == 5
+            &&  SendSocketDataTo(sock, "world", 5, &addr) == 5)
+                passTest(&state2, "");
+            else
+                failTest(&state2, "");
+        }
+    }
+
+    beginGroup(&state2);
+
+    if (startTest(&state2, "POLL for incoming datagram")) {
+        if (!skipTest(&state2)) {
+            do {
+                if (!serialRequest(&state2, "POLL"))
+                    break;
+            } while (!waitAndCheckSerialResponse(&state2, "=N,0,0", "=D,^i,^i", &handle, &count));
+        }
+    }
+
+    // the sender's address and port must survive the frame encoding as separate fields
+    if (startTest(&state2, "RECV frame")) {
+        if (!skipTest(&state2) && frameRequest(&state2, CMD_RECV_BYTE, 2, handle, 16)) {
+            checkFrameResponse(&state2, "=S,5,^s,^i", ipaddr, sizeof(ipaddr), &port);
+            if (state2.testPassed && (sscanf(ipaddr, "%d.%d.%d.%d", &a, &b, &c, &d) != 4 || port == 0))
+                failTest(&state2, ": sender %s:%d", ipaddr, port);
+            if (state2.testPassed)
+                checkPayload(&state2, "hello", 5);
+        }
+    }
+
+    if (startTest(&state2, "RECVFROM frame")) {
+        if (!skipTest(&state2) && frameRequest(&state2, CMD_RECVFROM_BYTE, 2, handle, 2)) {
+            checkFrameResponse(&state2, "=S,2,^s,^i", ipaddr, sizeof(ipaddr), &port);
+            if (state2.testPassed && (sscanf(ipaddr, "%d.%d.%d.%d", &a, &b, &c, &d) != 4 || port == 0))
+                failTest(&state2, ": sender %s:%d", ipaddr, port);
+            if (state2.testPassed)
+                checkPayload(&state2, "wo", 2);
+        }
+    }
+
+    if (startTest(&state2, "CLOSE")) {
+        if (!skipTest(&state2) && serialRequest(&state2, "CLOSE:%d", handle))
+            checkSerialResponse(&state2, "=S,0");
+    }
+
+    if (sock != INVALID_SOCKET)
+        CloseSocket(sock);
+
+    testResults(&state2);
+
+    return state2.testPassed;
+}